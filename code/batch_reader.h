@@ -0,0 +1,813 @@
+#pragma once
+
+#include "particle.h"
+#include "thread_pool.h"
+
+#include <future>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+	Een bestand dat in zijn geheel in het geheugen gemapt is (alleen lezen).
+*/
+class MappedFile {
+public:
+	explicit MappedFile(const char *file_name) {
+		int fd = open(file_name, O_RDONLY);
+		if (fd < 0) {
+			std::cerr << strerror(errno) << ':' << file_name << '\n';
+			return;
+		}
+
+		struct stat st;
+		opened = !fstat(fd, &st);
+		if (opened && st.st_size > 0) {
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				begin = static_cast<const unsigned char *>(p);
+				length = st.st_size;
+			} else {
+				std::cerr << strerror(errno) << ':' << file_name << '\n';
+				opened = false;
+			}
+		}
+		close(fd);
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile() {
+		if (begin) munmap(const_cast<unsigned char *>(begin), length);
+	}
+
+	const unsigned char *data() const {
+		return begin;
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+	// false als het bestand niet geopend of gemapt kon worden; een leeg bestand is ok
+	bool ok() const {
+		return opened;
+	}
+
+private:
+	const unsigned char *begin = nullptr;
+	size_t length = 0;
+	bool opened = false;
+};
+
+inline int read_u16(const unsigned char *p) {
+	uint16_t x;
+	std::memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+// leest een varint van Particle::write_varint en zet p erachter
+inline uint64_t read_varint(const unsigned char *&p) {
+	uint64_t x = 0;
+	for (int shift = 0;; shift += 7) {
+		uint64_t b = *p++;
+		x |= (b & 0x7f) << shift;
+		if (b < 0x80) return x;
+	}
+}
+
+// hetzelfde, maar false als de varint niet voor end afgelopen is
+inline bool read_varint(const unsigned char *&p, const unsigned char *end, uint64_t &x) {
+	// bijna alles past in 1 of 2 bytes, dat gaat zonder sprong die van de lengte afhangt
+	if (end - p >= 2 && !(p[0] & p[1] & 0x80)) {
+		uint64_t more = p[0] >> 7;
+		x = (p[0] & 0x7f) | ((p[1] & 0x7f) << 7) * more;
+		p += 1 + more;
+		return true;
+	}
+
+	x = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint64_t b = *p++;
+		x |= (b & 0x7f) << shift;
+		if (b < 0x80) return true;
+	}
+	return false;
+}
+
+inline const unsigned char *skip_varints(const unsigned char *p, int n) {
+	for (int i = 0; i < n; ++p) i += *p < 0x80;
+	return p;
+}
+
+inline int64_t unzigzag(uint64_t x) {
+	return int64_t(x >> 1) ^ -int64_t(x & 1);
+}
+
+/*
+	Een deeltje zoals het in het batch bestand staat, zonder het uit te pakken.
+	zeros en pixels wijzen direct in de gemapte data, in het formaat van version.
+	Als het bestand een samenvatting per deeltje heeft kosten pixel_count, energy en
+	max_value niets, en wordt pixels pas opgezocht als de pixels nodig zijn.
+*/
+struct ParticleView {
+	Particle::sys_clock::time_point time_point{};
+	int start_x{};
+	int start_y{};
+	int width{};
+	int height{};
+
+	int version = 1;
+	const unsigned char *zeros = nullptr;	// zero_count paren (index, lengte) van 2 bytes, of (afstand, lengte) als varints
+	int zero_count{};
+	const unsigned char *pixels = nullptr;	// pixel_count waardes van 2 bytes, of varints
+	int pixel_count{};
+
+	bool summary = false;
+	int energy_sum{};
+	int max_hit{};
+
+	int area() const {
+		return width * height;
+	}
+
+	template <typename S = SingleChip>
+	bool touches_border() const {
+		return S::touches_border(start_x, start_y, width, height);
+	}
+
+	// roept f(waarde) aan voor elke pixel die niet 0 is
+	template <typename Function>
+	void for_each_value(Function f) const {
+		if (version == 1) {
+			for (int i = 0; i < pixel_count; ++i) f(read_u16(pixels + 2 * i));
+		} else {
+			auto p = compact_pixels();
+			for (int i = 0; i < pixel_count; ++i) f(int(read_varint(p)));
+		}
+	}
+
+	int max_value() const {
+		if (summary) return max_hit;
+		int m = 0;
+		for_each_value([&m](int v) { m = std::max(m, v); });
+		return m;
+	}
+
+	int energy() const {
+		if (summary) return energy_sum;
+		int total = 0;
+		for_each_value([&total](int v) { total += v; });
+		return total;
+	}
+
+	// roept f(index in de bounding box, waarde) aan voor elke pixel die niet 0 is
+	template <typename Function>
+	void for_each_hit(Function f) const {
+		if (version == 1) {
+			int z = 0, next_zero = zero_count? read_u16(zeros): area();
+			for (int i = 0, v = 0; i < area();) {
+				if (i == next_zero) {
+					i += read_u16(zeros + 4 * z + 2);
+					next_zero = ++z < zero_count? read_u16(zeros + 4 * z): area();
+				} else f(i++, read_u16(pixels + 2 * v++));
+			}
+			return;
+		}
+
+		auto z = zeros, v = compact_pixels();
+		int i = 0;
+		for (int r = 0; r < zero_count; ++r) {
+			for (int gap_end = i + int(read_varint(z)); i < gap_end; ++i) f(i, int(read_varint(v)));
+			i += int(read_varint(z));
+		}
+		for (; i < area(); ++i) f(i, int(read_varint(v)));
+	}
+
+	// met memory komen de pixels daaruit, anders wordt de ruimte van p.data hergebruikt
+	void decode_into(Particle &p, std::pmr::memory_resource *memory = nullptr) const {
+		p.time_point = time_point;
+		p.start_x = start_x;
+		p.start_y = start_y;
+		p.width = width;
+		p.height = height;
+		if (memory) p.data = Particle::Pixels(area(), 0, memory);
+		else p.data.assign(area(), 0);
+		for_each_hit([&p](int i, int v) { p.data[i] = v; });
+	}
+
+	// hetzelfde, maar alleen de pixels die niet 0 zijn
+	void decode_into(SparseParticle &p, std::pmr::memory_resource *memory = nullptr) const {
+		p.time_point = time_point;
+		p.start_x = start_x;
+		p.start_y = start_y;
+		p.width = width;
+		p.height = height;
+		if (memory) p.hits = SparseParticle::Hits(memory);
+		else p.hits.clear();
+		p.hits.reserve(pixel_count);
+
+		// de index loopt op, dus x en y kunnen zonder delen bijgehouden worden
+		int x = 0, y = 0, at = 0;
+		for_each_hit([&](int i, int v) {
+			x += i - at;
+			at = i;
+			while (x >= width) {
+				x -= width;
+				++y;
+			}
+			p.hits.push_back({uint16_t(x), uint16_t(y), Particle::Pixel(v)});
+		});
+	}
+
+	Particle to_particle() const {
+		Particle p;
+		decode_into(p);
+		return p;
+	}
+
+private:
+	const unsigned char *compact_pixels() const {
+		return pixels? pixels: skip_varints(zeros, 2 * zero_count);
+	}
+};
+
+// deeltjes [first, first + count) die in de bytes [begin, end) van een batch bestand staan
+struct BatchRange {
+	uint32_t first{};
+	uint32_t count{};
+	size_t begin{};
+	size_t end{};
+	int64_t time{};	// tijd van deeltje first - 1, nodig voor versie 2
+};
+
+/*
+	Index met de byte offset van elk stride-ste deeltje. Staat naast het batch bestand
+	in [bestand].idx:
+		"PID2", uint32_t stride, uint32_t count, uint64_t size, Entry entries[]
+	count en size zijn het aantal deeltjes en de bestandsgrootte van het batch bestand
+	waar de index bij hoort. Als die niet kloppen is de index verouderd.
+	Een entry heeft ook de tijd van het deeltje ervoor, want in versie 2 is de tijd
+	van een deeltje een verschil met die tijd.
+*/
+struct BatchIndex {
+	static constexpr char MAGIC[4] = {'P', 'I', 'D', '2'};
+	static constexpr uint32_t DEFAULT_STRIDE = 64;
+	static constexpr size_t HEADER_SIZE = 4 + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+	struct Entry {
+		uint64_t offset;
+		int64_t time;
+	};
+
+	uint32_t stride = DEFAULT_STRIDE;
+	uint32_t count = 0;
+	uint64_t size = 0;
+	std::vector<Entry> entries;
+
+	static std::string file_name(const char *batch_file) {
+		return std::string(batch_file) + ".idx";
+	}
+
+	// offset is de positie van deeltje count, het volgende deeltje, en time de tijd van het deeltje ervoor
+	void add(uint64_t offset, int64_t time) {
+		if (count++ % stride == 0) entries.push_back({offset, time});
+	}
+
+	bool matches(uint32_t batch_count, uint64_t batch_size) const {
+		return count == batch_count && size == batch_size;
+	}
+
+	bool load(const char *batch_file) {
+		std::ifstream f(file_name(batch_file), std::ios_base::binary);
+		char magic[4]{};
+		f.read(magic, 4);
+		f.read(reinterpret_cast<char*>(&stride), sizeof(stride));
+		f.read(reinterpret_cast<char*>(&count), sizeof(count));
+		f.read(reinterpret_cast<char*>(&size), sizeof(size));
+		if (!f || std::memcmp(magic, MAGIC, 4) || !stride) return false;
+
+		entries.resize((count + stride - 1) / stride);
+		f.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(Entry));
+		return bool(f);
+	}
+
+	// schrijft de header en de entries vanaf from; de entries ervoor staan er al
+	void save(const char *batch_file, size_t from = 0) const {
+		auto name = file_name(batch_file);
+		std::fstream f;
+		if (from) f.open(name, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+		if (!f.is_open()) f.open(name, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+
+		f.write(MAGIC, 4);
+		f.write(reinterpret_cast<const char*>(&stride), sizeof(stride));
+		f.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		f.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		f.seekp(HEADER_SIZE + from * sizeof(Entry));
+		f.write(reinterpret_cast<const char*>(entries.data() + from), (entries.size() - from) * sizeof(Entry));
+	}
+
+	static BatchIndex build(const char *batch_file, uint32_t stride = DEFAULT_STRIDE);
+};
+
+/*
+	Loopt de deeltjes van een batch bestand af in de gemapte data.
+*/
+class BatchReader {
+public:
+	explicit BatchReader(const char *file_name) : name(file_name), file(file_name) {
+		if (file.size() && !batch_header.parse(reinterpret_cast<const char *>(file.data()), file.size())) {
+			std::cerr << file_name << " is not a batch file of a known version\n";
+			batch_header = BatchHeader{};
+			known = false;
+		}
+		count = limit = batch_header.count;
+		position = batch_header.size;
+	}
+
+	const BatchHeader &header() const {
+		return batch_header;
+	}
+
+	// false als het bestand er niet is of geen batch bestand is; het is dan leeg
+	bool ok() const {
+		return file.ok() && known;
+	}
+
+	// aantal deeltjes volgens de header
+	uint32_t size() const {
+		return count;
+	}
+
+	// index van het volgende deeltje
+	uint32_t index() const {
+		return read;
+	}
+
+	// byte offset van het volgende deeltje
+	size_t offset() const {
+		return position;
+	}
+
+	// tijd van het laatst gelezen deeltje, als count van de tijd
+	int64_t time() const {
+		return last_time;
+	}
+
+	// false aan het eind, of als het laatste deeltje niet compleet in het bestand staat
+	bool next(ParticleView &view) {
+		if (read >= limit) return false;
+
+		auto p = file.data() + position;
+		auto end = file.data() + file.size();
+		view.version = batch_header.version;
+		if (view.version != 1) return next_compact(view, p, end);
+
+		constexpr size_t HEADER = sizeof(Particle::sys_clock::rep) + 5 * 2;
+		if (end - p < (ptrdiff_t)HEADER) return truncated();
+
+		std::memcpy(&last_time, p, sizeof(last_time));
+		p += sizeof(last_time);
+		view.time_point = Particle::sys_clock::time_point{Particle::sys_clock::duration{last_time}};
+		view.start_x = read_u16(p);
+		view.start_y = read_u16(p + 2);
+		view.width = read_u16(p + 4);
+		view.height = read_u16(p + 6);
+		view.zero_count = read_u16(p + 8);
+		p += 10;
+
+		if (end - p < 4 * view.zero_count) return truncated();
+		view.zeros = p;
+		int empty = 0;
+		for (int z = 0; z < view.zero_count; ++z) empty += read_u16(p + 4 * z + 2);
+		p += 4 * view.zero_count;
+
+		view.pixel_count = std::max(view.area() - empty, 0);
+		if (end - p < 2 * view.pixel_count) return truncated();
+		view.pixels = p;
+		p += 2 * view.pixel_count;
+
+		position = p - file.data();
+		++read;
+		return true;
+	}
+
+	/*
+		De index van dit bestand. Uit [bestand].idx als die er is en klopt,
+		anders wordt hij hier opgebouwd door alleen de headers van de deeltjes te lezen.
+	*/
+	const BatchIndex &batch_index() {
+		if (!index_loaded) {
+			index_loaded = true;
+			if (!offsets.load(name.data()) || !offsets.matches(count, file.size())) {
+				auto saved = std::make_tuple(read, limit, position, last_time);
+				offsets = BatchIndex{};
+				read = 0;
+				limit = count;
+				position = batch_header.size;
+				last_time = 0;
+				ParticleView view;
+				for (;;) {
+					auto at = position;
+					auto before = last_time;
+					if (!next(view)) break;
+					offsets.add(at, before);
+				}
+				offsets.size = position;
+				std::tie(read, limit, position, last_time) = saved;
+			}
+		}
+		return offsets;
+	}
+
+	// zet de reader op deeltje k, false als k niet bestaat
+	bool seek(uint32_t k) {
+		auto &index = batch_index();
+		if (k >= index.count) return false;
+		read = k - k % index.stride;
+		position = index.entries[k / index.stride].offset;
+		last_time = index.entries[k / index.stride].time;
+		limit = count;
+
+		ParticleView view;
+		while (read < k) next(view);
+		return true;
+	}
+
+	/*
+		Zet de reader op het eerste deeltje met een tijd (als count van sys_clock) van minstens t,
+		of aan het eind. De deeltjes moeten op volgorde van tijd staan, zoals de compressor ze
+		schrijft. Met de index wordt binair gezocht, daarna worden hoogstens stride deeltjes gelezen.
+	*/
+	void seek_time(int64_t t) {
+		auto &index = batch_index();
+		limit = count;
+		if (index.entries.empty()) return;
+
+		// entry e heeft de tijd van deeltje e * stride - 1, dus het deeltje staat in het blok voor de eerste entry met een tijd >= t
+		auto after = std::lower_bound(index.entries.begin(), index.entries.end(), t, [](const BatchIndex::Entry &e, int64_t x) { return e.time < x; });
+		size_t e = std::max<ptrdiff_t>(after - index.entries.begin() - 1, 0);
+		read = e * index.stride;
+		position = index.entries[e].offset;
+		last_time = index.entries[e].time;
+
+		ParticleView view;
+		for (;;) {
+			auto saved = std::make_tuple(read, position, last_time);
+			if (!next(view)) break;
+			if (view.time_point.time_since_epoch().count() >= t) {
+				std::tie(read, position, last_time) = saved;
+				break;
+			}
+		}
+	}
+
+	// de deeltjes met een tijd in [from, to), zie seek_time
+	BatchRange time_range(int64_t from, int64_t to) {
+		seek_time(to);
+		auto end = std::make_pair(read, position);
+		seek_time(from);
+		uint32_t n = end.first > read? end.first - read: 0;
+		return {read, n, position, std::max(end.second, position), last_time};
+	}
+
+	// leest alleen de deeltjes van range
+	void restrict(const BatchRange &range) {
+		read = range.first;
+		limit = range.first + range.count;
+		position = range.begin;
+		last_time = range.time;
+	}
+
+	// verdeelt het bestand in hoogstens n stukken van ongeveer evenveel bytes
+	std::vector<BatchRange> split(unsigned n) {
+		auto &index = batch_index();
+		std::vector<BatchRange> result;
+		if (!index.count) return result;
+
+		size_t begin = batch_header.size, total = index.size - begin;
+		uint32_t first = 0;
+		for (unsigned i = 1; i <= n; ++i) {
+			uint32_t last = index.count;
+			if (i < n) {
+				size_t target = begin + total * i / n;
+				auto it = std::lower_bound(index.entries.begin(), index.entries.end(), target, [](const BatchIndex::Entry &e, size_t x) { return e.offset < x; });
+				last = std::min<uint32_t>((it - index.entries.begin()) * index.stride, index.count);
+			}
+			if (last <= first) continue;
+
+			auto &from = index.entries[first / index.stride];
+			auto to = last < index.count? index.entries[last / index.stride].offset: index.size;
+			result.push_back({first, last - first, from.offset, to, from.time});
+			first = last;
+		}
+		return result;
+	}
+
+private:
+	std::string name;
+	MappedFile file;
+	BatchHeader batch_header;
+	bool known = true;
+	uint32_t count = 0;
+	uint32_t read = 0;
+	uint32_t limit = 0;
+	size_t position = 0;
+	int64_t last_time = 0;
+
+	bool index_loaded = false;
+	BatchIndex offsets;
+
+	bool next_compact(ParticleView &view, const unsigned char *p, const unsigned char *end) {
+		uint64_t delta, box[4], zero_count;
+		if (!read_varint(p, end, delta)) return truncated();
+		for (auto &v : box) {
+			if (!read_varint(p, end, v) || v > UINT16_MAX) return truncated();
+		}
+		last_time += unzigzag(delta);
+		view.time_point = Particle::sys_clock::time_point{Particle::sys_clock::duration{last_time}};
+		view.start_x = box[0];
+		view.start_y = box[1];
+		view.width = box[2];
+		view.height = box[3];
+
+		view.summary = batch_header.flags & BatchHeader::SUMMARY;
+		if (view.summary) {
+			// de pixels niet bekijken, alleen hun grootte
+			uint64_t hits, energy, max, size;
+			if (!read_varint(p, end, hits) || !read_varint(p, end, energy) || !read_varint(p, end, max) || !read_varint(p, end, size)) return truncated();
+			if (uint64_t(end - p) < size || hits > uint64_t(view.area())) return truncated();
+			auto payload_end = p + size;
+			if (!read_varint(p, payload_end, zero_count)) return truncated();
+
+			view.pixel_count = hits;
+			view.energy_sum = energy;
+			view.max_hit = max;
+			view.zero_count = zero_count;
+			view.zeros = p;
+			view.pixels = nullptr;
+			position = payload_end - file.data();
+			++read;
+			return true;
+		}
+
+		if (!read_varint(p, end, zero_count)) return truncated();
+		view.zero_count = zero_count;
+		view.zeros = p;
+		int64_t empty = 0;
+		for (int z = 0; z < view.zero_count; ++z) {
+			uint64_t gap, length;
+			if (!read_varint(p, end, gap) || !read_varint(p, end, length)) return truncated();
+			empty += length;
+		}
+
+		// de pixels alleen overslaan: elke varint eindigt met een byte onder 0x80
+		view.pixel_count = std::max<int64_t>(view.area() - empty, 0);
+		view.pixels = p;
+		for (int i = 0; i < view.pixel_count; ++p) {
+			if (p == end) return truncated();
+			i += *p < 0x80;
+		}
+
+		position = p - file.data();
+		++read;
+		return true;
+	}
+
+	bool truncated() {
+		std::cerr << "batch file ends in the middle of particle " << read << '\n';
+		count = limit = read;
+		return false;
+	}
+};
+
+inline BatchIndex BatchIndex::build(const char *batch_file, uint32_t stride) {
+	BatchReader reader(batch_file);
+	BatchIndex index;
+	index.stride = stride;
+
+	ParticleView view;
+	for (;;) {
+		auto at = reader.offset();
+		auto before = reader.time();
+		if (!reader.next(view)) break;
+		index.add(at, before);
+	}
+	index.size = reader.offset();
+	return index;
+}
+
+/*
+	Loopt de rest van reader af. Deeltjes waarvoor pre(ParticleView) false geeft worden
+	niet uitgepakt. Van de rest wordt het eerste element van een Tuple gevuld, en als
+	f(tuple) true geeft gaat de tuple naar consume, in de volgorde van het bestand.
+
+	Met threads != 1 gebeurt het uitpakken op deze thread en het filteren met f in blokken
+	op een ThreadPool. f wordt dan vanuit meerdere threads tegelijk aangeroepen en mag
+	alleen zijn eigen tuple aanpassen. consume wordt altijd op deze thread aangeroepen.
+
+	Met memory komen de pixels van de deeltjes daaruit; het uitpakken, en dus het
+	alloceren, gebeurt altijd op deze thread.
+*/
+template <typename Tuple = std::tuple<Particle>, typename Predicate, typename Function, typename Consumer>
+inline void for_each_filtered(BatchReader &reader, Predicate pre, Function f, Consumer consume, unsigned threads, std::pmr::memory_resource *memory = nullptr) {
+	ParticleView view;
+
+	if (threads == 1) {
+		Tuple t;
+		while (reader.next(view)) {
+			if (!pre(view)) continue;
+			t = Tuple();
+			view.decode_into(std::get<0>(t), memory);
+			if (f(t)) consume(std::move(t));
+		}
+		return;
+	}
+
+	constexpr size_t CHUNK_SIZE = 256;
+
+	struct Chunk {
+		std::vector<Tuple> tuples;
+		std::vector<char> keep;
+		std::promise<void> done;
+	};
+
+	ThreadPool pool(threads);
+	const size_t max_in_flight = 4 * pool.size();
+
+	std::deque<std::pair<std::shared_ptr<Chunk>, std::future<void>>> in_flight;
+	auto collect = [&]() {
+		auto &[chunk, done] = in_flight.front();
+		done.get();
+		for (size_t i = 0; i < chunk->tuples.size(); ++i) {
+			if (chunk->keep[i]) consume(std::move(chunk->tuples[i]));
+		}
+		in_flight.pop_front();
+	};
+
+	for (bool more = true; more;) {
+		auto chunk = std::make_shared<Chunk>();
+		chunk->tuples.reserve(CHUNK_SIZE);
+		while (chunk->tuples.size() < CHUNK_SIZE && (more = reader.next(view))) {
+			if (!pre(view)) continue;
+			chunk->tuples.emplace_back();
+			view.decode_into(std::get<0>(chunk->tuples.back()), memory);
+		}
+		chunk->keep.resize(chunk->tuples.size());
+
+		if (in_flight.size() >= max_in_flight) collect();
+		in_flight.emplace_back(chunk, chunk->done.get_future());
+		pool.submit([chunk, &f]() {
+			try {
+				for (size_t i = 0; i < chunk->tuples.size(); ++i) chunk->keep[i] = bool(f(chunk->tuples[i]));
+				chunk->done.set_value();
+			} catch (...) {
+				chunk->done.set_exception(std::current_exception());
+			}
+		});
+	}
+	while (!in_flight.empty()) collect();
+}
+
+/*
+	Volgt een batch bestand waar een BatchWriter (compressor auto of watch) nog in schrijft,
+	zoals tail -f: poll geeft een reader over de deeltjes die er sinds de vorige poll bij
+	gekomen zijn, en de volgende poll gaat verder waar die reader gebleven is.
+
+	De writer schrijft eerst de deeltjes en daarna pas het aantal in de header. Daarom wordt
+	hier eerst het aantal gelezen en daarna pas het bestand gemapt, zodat alle deeltjes die
+	het aantal belooft zeker in de map staan; wat erachter staat wordt niet gelezen. Het
+	aantal wordt gelezen tot het twee keer achter elkaar hetzelfde is, zodat een header die
+	net half geschreven is niet meetelt.
+
+	Als het aantal kleiner wordt of de header verandert is het bestand vervangen (een nieuwe
+	meting); dan begint poll opnieuw bij het eerste deeltje en geeft restarted() true.
+*/
+class BatchFollower {
+public:
+	explicit BatchFollower(std::string file_name) : name(std::move(file_name)) {}
+
+	// nullptr als er niets nieuws is; de reader blijft geldig tot de volgende poll
+	BatchReader *poll() {
+		if (reader) {
+			count = reader->index();
+			offset = reader->offset();
+			time = reader->time();
+			reader.reset();
+		}
+		was_restarted = false;
+
+		BatchHeader current;
+		if (!read_header(current)) return nullptr;
+		if (!started || current.count < count || current.version != header.version || current.flags != header.flags || !current.same_sensor(header)) {
+			if (started) std::cerr << name << " was replaced, starting from the beginning\n";
+			was_restarted = started;
+			started = true;
+			count = 0;
+			offset = current.size;
+			time = 0;
+		}
+		header = current;
+		if (header.count == count) return nullptr;
+
+		reader = std::make_unique<BatchReader>(name.data());
+		reader->restrict({count, header.count - count, offset, 0, time});
+		return reader.get();
+	}
+
+	// of de laatste poll opnieuw begonnen is omdat het bestand vervangen is
+	bool restarted() const {
+		return was_restarted;
+	}
+
+	// de header van de laatste poll, met het aantal deeltjes dat er toen zeker stond
+	const BatchHeader &batch_header() const {
+		return header;
+	}
+
+private:
+	std::string name;
+	std::unique_ptr<BatchReader> reader;
+	BatchHeader header;
+	bool started = false, was_restarted = false;
+	uint32_t count = 0;
+	size_t offset = 0;
+	int64_t time = 0;
+
+	/*
+		false als er (nog) geen complete header is. Een bestand dat net gemaakt is kan nog
+		alleen nullen of een half geschreven v2 header bevatten; als v1 header gelezen zou
+		dat met een aantal van 0 beginnen en daarna als vervangen bestand opnieuw beginnen
+		zodra de echte header er staat, dus dan wordt er gewoon gewacht.
+	*/
+	bool read_header(BatchHeader &h) const {
+		int fd = open(name.data(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return false;
+		static constexpr char zeros[BatchHeader::MAX_SIZE] = {};
+		char data[BatchHeader::MAX_SIZE];
+		BatchHeader previous;
+		bool ok = false;
+		for (int attempt = 0; attempt < 100 && !ok; ++attempt) {
+			auto n = pread(fd, data, sizeof(data), 0);
+			if (n <= 0 || !std::memcmp(data, zeros, n)) break;
+			bool magic = !std::memcmp(data, BatchHeader::MAGIC, std::min<size_t>(n, sizeof(BatchHeader::MAGIC)));
+			if (!h.parse(data, n) || (magic && h.version != 2)) break;
+			ok = attempt && h.count == previous.count;
+			previous = h;
+		}
+		close(fd);
+		return ok;
+	}
+};
+
+// de arena moet later weg dan de tuples, dus staat hij in een base class voor de vector
+struct BatchArena {
+	static constexpr size_t INITIAL_SIZE = 1 << 16;
+
+	std::unique_ptr<std::pmr::monotonic_buffer_resource> arena = std::make_unique<std::pmr::monotonic_buffer_resource>(INITIAL_SIZE);
+};
+
+/*
+	De tuples van read_batch_filtered. De pixels van hun deeltjes staan samen in 1 arena,
+	die in 1 keer vrijgegeven wordt als de batch weg is. Een kopie van een deeltje staat
+	gewoon op de heap en mag langer bestaan.
+*/
+template <typename Tuple>
+struct FilteredBatch : BatchArena, std::vector<Tuple> {};
+
+/*
+	Leest alle deeltjes van een batch bestand (of de rest van reader) met for_each_filtered
+	en geeft de tuples terug waarvoor f true gaf. Deeltjes die pre doorlaat maar f niet
+	houden hun plek in de arena tot de batch weg is.
+*/
+template <typename Tuple = std::tuple<Particle>, typename Predicate, typename Function>
+inline FilteredBatch<Tuple> read_batch_filtered(BatchReader &reader, Predicate pre, Function f, unsigned threads) {
+	FilteredBatch<Tuple> result;
+	result.reserve(reader.size() - reader.index());
+	for_each_filtered<Tuple>(reader, pre, f, [&result](Tuple &&t) { result.push_back(std::move(t)); }, threads, result.arena.get());
+	return result;
+}
+
+template <typename Tuple = std::tuple<Particle>, typename Predicate, typename Function>
+inline FilteredBatch<Tuple> read_batch_filtered(const char *file_name, Predicate pre, Function f, unsigned threads) {
+	BatchReader reader(file_name);
+	std::cerr << file_name << " contains " << reader.size() << " particles\n";
+	return read_batch_filtered<Tuple>(reader, pre, f, threads);
+}
+
+template <typename Tuple = std::tuple<Particle>, typename Function>
+inline FilteredBatch<Tuple> read_batch_filtered(const char *file_name, Function f, unsigned threads) {
+	return read_batch_filtered<Tuple>(file_name, [](const ParticleView &) { return true; }, f, threads);
+}
+
+template <typename Tuple = std::tuple<Particle>, typename Function>
+inline FilteredBatch<Tuple> read_batch_filtered(const char *file_name, Function f) {
+	return read_batch_filtered<Tuple>(file_name, f, 1);
+}
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "particle.h"
+#include "batch_reader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+	Wanneer BatchWriter fsync doet:
+	never: nooit, het besturingssysteem schrijft het wel een keer weg
+	close: 1 keer bij het sluiten
+	flush: bij elke flush, eerst na de deeltjes en dan nog eens na de header
+*/
+enum class SyncPolicy { never, close, flush };
+
+/*
+	Voegt deeltjes toe aan een batch bestand dat open blijft.
+
+	De deeltjes komen in een buffer die met 1 write wordt weggeschreven na elke
+	frames_per_flush frames (zie end_frame), of eerder als de buffer vol is.
+	Het aantal in de header wordt pas na de deeltjes zelf bijgewerkt, dus een lezer
+	of een crash ziet nooit een aantal dat meer deeltjes belooft dan er staan.
+
+	Bytes achter de getelde deeltjes, van een flush die niet afkwam, worden bij het openen
+	weggegooid. Waar de getelde deeltjes ophouden staat in de header (data_end); alleen
+	bij headers zonder data_end (versie 1 en oude versie 2) worden de deeltjes daarvoor
+	afgelopen, als de index ([bestand].idx) er niet is of niet klopt. Als er een index is
+	wordt die bijgehouden.
+
+	Als een write mislukt geven flush en flushed false tot een volgende flush wel lukt. Na
+	een mislukte fdatasync blijven ze false: wat er op de schijf staat is dan niet zeker meer.
+
+	De deeltjes worden geschreven in de versie van het bestand; een leeg bestand wordt
+	versie BatchHeader::LATEST van een SingleChip.
+*/
+class BatchWriter {
+public:
+	static constexpr size_t MAX_BUFFER = 1 << 22;
+
+	explicit BatchWriter(const char *file_name, unsigned frames_per_flush = 1, SyncPolicy sync = SyncPolicy::never)
+		: name(file_name), frames_per_flush(std::max(1u, frames_per_flush)), sync(sync) {
+		fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			error();
+			return;
+		}
+
+		off_t size = lseek(fd, 0, SEEK_END);
+		char data[BatchHeader::MAX_SIZE];
+		auto n = pread(fd, data, sizeof(data), 0);
+		if (!size) {
+			// nog geen header, die komt er bij de eerste flush
+			written = -1;
+		} else if (n < 0 || !batch_header.parse(data, n)) {
+			std::cerr << file_name << " is not a batch file of a known version\n";
+			::close(fd);
+			fd = -1;
+			return;
+		} else written = batch_header.count;
+		end = std::max<uint64_t>(size, batch_header.size);
+
+		indexed = index.load(file_name);
+		if (!size) {
+			// een index naast een leeg bestand is van een vorig bestand met dezelfde naam
+			indexed = false;
+			return;
+		}
+
+		// bytes achter de getelde deeltjes zijn van een flush die niet afkwam
+		bool rebuilt = false;
+		if (batch_header.has_data_end()) truncate(batch_header.data_end);
+		else if (!batch_header.count) truncate(batch_header.size);
+		else if (indexed && !index.matches(batch_header.count, end)) {
+			index = BatchIndex::build(file_name, index.stride);
+			rebuilt = true;
+			if (index.count == batch_header.count) truncate(index.size);
+		} else if (!indexed) {
+			BatchReader reader(file_name);
+			ParticleView view;
+			while (reader.next(view)) {}
+			if (reader.index() == batch_header.count) truncate(reader.offset());
+		}
+
+		if (indexed && !rebuilt && !index.matches(batch_header.count, end)) {
+			index = BatchIndex::build(file_name, index.stride);
+			rebuilt = true;
+		}
+		if (indexed && !index.matches(batch_header.count, end)) indexed = false;
+		saved_entries = rebuilt? 0: index.entries.size();
+	}
+
+	BatchWriter(const BatchWriter &) = delete;
+	BatchWriter &operator=(const BatchWriter &) = delete;
+
+	~BatchWriter() {
+		close();
+	}
+
+	bool ok() const {
+		return fd >= 0;
+	}
+
+	// aantal deeltjes, ook die nog in de buffer staan
+	uint32_t size() const {
+		return batch_header.count;
+	}
+
+	uint16_t version() const {
+		return batch_header.version;
+	}
+
+	// grootte van het bestand, zonder wat nog in de buffer staat
+	uint64_t file_size() const {
+		return end;
+	}
+
+	// de header zoals hij na de volgende flush in het bestand staat
+	const BatchHeader &header() const {
+		return batch_header;
+	}
+
+	void add(const Particle &p) {
+		if (indexed) index.add(end + buffer.size(), batch_header.last_time);
+		if (batch_header.version == 1) p.encode(buffer);
+		else p.encode_compact(buffer, batch_header.last_time, batch_header.flags & BatchHeader::SUMMARY);
+		batch_header.last_time = p.time_point.time_since_epoch().count();
+		++batch_header.count;
+		if (buffer.size() >= MAX_BUFFER) flush();
+	}
+
+	// true als alles tot en met dit frame in het bestand staat
+	bool end_frame() {
+		if (++frames % frames_per_flush == 0) flush();
+		return flushed();
+	}
+
+	bool write(const std::vector<Particle> &particles) {
+		for (auto &p : particles) add(p);
+		return end_frame();
+	}
+
+	// true als alles in het bestand staat, en met SyncPolicy::flush ook op de schijf
+	bool flushed() const {
+		return !failed && buffer.empty() && written == (int64_t)batch_header.count;
+	}
+
+	bool flush() {
+		if (fd < 0) return false;
+
+		if (!buffer.empty()) {
+			if (!write_at(buffer.data(), buffer.size(), end)) return false;
+			end += buffer.size();
+			buffer.clear();
+			batch_header.data_end = end;
+			if (sync == SyncPolicy::flush && !data_sync()) return false;
+		}
+
+		if (written != (int64_t)batch_header.count) {
+			// alleen het deel van de header dat verandert, behalve de eerste keer
+			auto bytes = batch_header.encode();
+			size_t from = written < 0? 0: batch_header.count_offset();
+			if (!write_at(bytes.data() + from, bytes.size() - from, from)) return false;
+			written = batch_header.count;
+			if (sync == SyncPolicy::flush && !data_sync()) return false;
+		}
+
+		if (indexed && index.size != end) {
+			index.size = end;
+			index.save(name.data(), saved_entries);
+			saved_entries = index.entries.size();
+		}
+		return !failed;
+	}
+
+	// false als niet alles weggeschreven is
+	bool close() {
+		if (fd < 0) return false;
+		bool ok = flush();
+		if (sync != SyncPolicy::never && fsync(fd)) {
+			error();
+			ok = false;
+		}
+		::close(fd);
+		fd = -1;
+		return ok;
+	}
+
+private:
+	std::string name;
+	unsigned frames_per_flush;
+	SyncPolicy sync;
+	int fd = -1;
+
+	BatchHeader batch_header;
+	std::vector<char> buffer;
+	int64_t written = 0;	// het aantal in de header, -1 als die er nog niet is
+	uint64_t end = 0;		// einde van de deeltjes in het bestand
+	unsigned frames = 0;
+	bool failed = false;
+
+	BatchIndex index;
+	bool indexed = false;
+	size_t saved_entries = 0;
+
+	bool write_at(const char *data, size_t size, uint64_t offset) {
+		while (size) {
+			ssize_t n = pwrite(fd, data, size, offset);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				error();
+				return false;
+			}
+			data += n;
+			size -= n;
+			offset += n;
+		}
+		return true;
+	}
+
+	// gooit alles vanaf counted_end weg
+	void truncate(uint64_t counted_end) {
+		if (counted_end >= end) return;
+		if (ftruncate(fd, counted_end)) error();
+		else end = counted_end;
+	}
+
+	bool data_sync() {
+		if (!fdatasync(fd)) return true;
+		error();
+		failed = true;
+		return false;
+	}
+
+	void error() const {
+		std::cerr << strerror(errno) << ':' << name << '\n';
+	}
+};
@@ -0,0 +1,544 @@
+/*
+
+	Compileer met:
+	g++ -Wall -O2 -std=c++17 -pthread -o bench bench.cpp particle.cpp
+
+	Microbenchmarks. Elke regel van de uitvoer is een JSON object met de resultaten van 1 benchmark:
+	bench {namen...} (--metingen=MAP) (--simd=S)
+
+	Zonder namen worden alle benchmarks gedraaid. De eerste regel zegt met welke compiler
+	bench gebouwd is. ns is de tijd van 1 keer de hele benchmark; benchmarks over deeltjes
+	geven ook particles_per_s en ns_per_pixel, zodat builds met elkaar te vergelijken zijn.
+	query draait de standaard query van query over de bestanden in MAP (standaard ../metingen).
+	canvas controleert ook of een .cnv (query --binary-canvas) dezelfde waardes teruggeeft.
+	line_fit draait voor elke SIMD versie die de CPU kan, de andere benchmarks met --simd
+	(standaard auto, zie query).
+
+	Rauwe frames maken om compressor te meten zonder detector:
+	bench frames [data bestand beginletters] [aantal] (occupancy) (spoorlengte) (seed)
+	maakt [beginletters]_000.txt enzovoort (minstens 3 cijfers), met standaard occupancy 0.01
+	en sporen van 20 pixels. Daarna: compressor batch [gecomprimeerd] [beginletters] [aantal] [cijfers]
+
+*/
+
+#include "particle.h"
+#include "labeling.h"
+#include "batch_reader.h"
+#include "batch_writer.h"
+#include "line_fit.h"
+#include "query.h"
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+#include <unistd.h>
+
+using bench_clock = std::chrono::steady_clock;
+
+/*
+	Een rauw frame met ongeveer occupancy * AREA pixels die niet 0 zijn,
+	in sporen van gemiddeld track_length pixels.
+*/
+CANVAS synthetic_canvas(std::mt19937 &rng, double occupancy, int track_length) {
+	CANVAS c{};
+	std::uniform_int_distribution<int> pos(0, AREA - 1), value(5, 300), step(-1, 1);
+	std::poisson_distribution<int> length(track_length);
+	for (int hits = 0; hits < occupancy * AREA;) {
+		int x = pos(rng) % WIDTH, y = pos(rng) / WIDTH;
+		int dx = step(rng), dy = step(rng) | 1;
+		for (int i = std::max(1, length(rng)); i > 0 && x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT; --i, x += dx, y += dy) {
+			auto &v = c[x + y * WIDTH];
+			if (!v) ++hits;
+			v = value(rng);
+		}
+	}
+	return c;
+}
+
+std::string canvas_to_text(const CANVAS &c) {
+	std::string text;
+	int i = 0;
+	for (int y = 0; y < HEIGHT; ++y) {
+		for (int x = 0; x < WIDTH; ++x) {
+			text += std::to_string(c[i++]);
+			text += (x + 1 == WIDTH? '\n': ' ');
+		}
+	}
+	return text;
+}
+
+// de oude read_canvas met operator>>, als referentie
+CANVAS read_canvas_iostream(const std::string &file_name) {
+	std::ifstream file;
+	file.open(file_name.data());
+	CANVAS arr;
+	for (int i = 0; i < AREA; ++i) {
+		file >> arr[i];
+	}
+	file.close();
+	arr[(91-1) * WIDTH + 70-1] = 0;
+	return arr;
+}
+
+/*
+	Draait f minstens min_time lang en geeft de gemiddelde tijd per aanroep in ns.
+*/
+template <typename Function>
+double time_ns(Function f, double min_time = 0.5) {
+	f();
+	long runs = 0;
+	auto start = bench_clock::now();
+	std::chrono::duration<double> elapsed{};
+	do {
+		f();
+		++runs;
+		elapsed = bench_clock::now() - start;
+	} while (elapsed.count() < min_time);
+	return elapsed.count() * 1e9 / double(runs);
+}
+
+template <typename T>
+volatile T sink;
+
+void report(const std::string &name, double ns, const std::string &extra) {
+	std::cout << "{\"name\": \"" << name << "\", \"ns\": " << ns << extra << "}" << std::endl;
+}
+
+// extra velden voor een benchmark die in ns tijd particles deeltjes met samen pixels pixels verwerkt
+std::string throughput(size_t particles, size_t pixels, double ns) {
+	return ", \"particles\": " + std::to_string(particles) + ", \"pixels\": " + std::to_string(pixels)
+		+ ", \"particles_per_s\": " + std::to_string(double(particles) * 1e9 / ns)
+		+ ", \"ns_per_pixel\": " + std::to_string(pixels? ns / double(pixels): 0);
+}
+
+size_t pixel_count(const Particle &p) {
+	return std::count_if(p.data.begin(), p.data.end(), [](int x) { return x != 0; });
+}
+
+size_t pixel_count(const std::vector<Particle> &particles) {
+	size_t n = 0;
+	for (auto &p : particles) n += pixel_count(p);
+	return n;
+}
+
+// de deeltjes van frames synthetische frames
+std::vector<Particle> synthetic_particles(std::mt19937 &rng, int frames, double occupancy, int track_length) {
+	Labeler labeler;
+	std::vector<Particle> result;
+	for (int i = 0; i < frames; ++i) {
+		auto particles = labeler.find_particles(synthetic_canvas(rng, occupancy, track_length));
+		result.insert(result.end(), particles.begin(), particles.end());
+	}
+	return result;
+}
+
+std::string temporary_file(const char *name) {
+	return std::string("/tmp/bench_") + name + "_" + std::to_string(getpid());
+}
+
+void bench_read_canvas() {
+	std::mt19937 rng(1);
+	auto name = std::string("/tmp/bench_frame_") + std::to_string(getpid()) + ".txt";
+
+	for (double occupancy : {0.001, 0.01, 0.1}) {
+		auto canvas = synthetic_canvas(rng, occupancy, 20);
+		auto text = canvas_to_text(canvas);
+		std::ofstream(name) << text;
+
+		if (read_canvas(name) != read_canvas_iostream(name)) std::cerr << "read_canvas differs from read_canvas_iostream\n";
+
+		auto extra = ", \"occupancy\": " + std::to_string(occupancy) + ", \"bytes\": " + std::to_string(text.size());
+		report("read_canvas/iostream", time_ns([&] { sink<int> = read_canvas_iostream(name)[0]; }), extra);
+		report("read_canvas", time_ns([&] { sink<int> = read_canvas(name)[0]; }), extra);
+		report("parse_canvas", time_ns([&] {
+			CANVAS c;
+			parse_canvas(text.data(), text.data() + text.size(), c);
+			sink<int> = c[0];
+		}), extra);
+	}
+	std::remove(name.data());
+}
+
+/*
+	De canvassen van query (max, sum en count) als tekst en als .cnv schrijven, en .cnv weer
+	lezen met read_canvas_binary; dat moet dezelfde waardes geven.
+*/
+void bench_canvas() {
+	std::mt19937 rng(7);
+	CanvasLayers<SingleChip> layers(CANVAS_MAX | CANVAS_SUM | CANVAS_COUNT);
+	for (auto &p : synthetic_particles(rng, 200, 0.01, 20)) layers.imprint(p);
+
+	auto name = temporary_file("canvas");
+	auto file_size = [&] { return std::to_string(std::ifstream(name, std::ios_base::ate | std::ios_base::binary).tellg()); };
+	auto bench_values = [&](const char *mode, const auto &values) {
+		double ns = time_ns([&] { write_values_to_file<SingleChip>(values, name.data()); });
+		report(std::string("canvas/") + mode + "/text", ns, ", \"bytes\": " + file_size());
+		ns = time_ns([&] { write_canvas_binary<SingleChip>(values, name.data()); });
+		report(std::string("canvas/") + mode + "/cnv", ns, ", \"bytes\": " + file_size());
+
+		int width, height;
+		std::vector<int64_t> read;
+		if (!read_canvas_binary(name.data(), width, height, read) || width != SingleChip::WIDTH || height != SingleChip::HEIGHT
+			|| !std::equal(read.begin(), read.end(), values.begin(), values.end())) std::cerr << "canvas/" << mode << ": the .cnv differs from the canvas\n";
+		report(std::string("canvas/") + mode + "/read_cnv", time_ns([&] {
+			read_canvas_binary(name.data(), width, height, read);
+			sink<int64_t> = read[0];
+		}), "");
+	};
+	bench_values("max", layers.max);
+	bench_values("sum", layers.sum);
+	bench_values("count", layers.count);
+	std::remove(name.data());
+}
+
+// versie 1 deeltjes schrijven en lezen met save_to_file en read_from_file
+void bench_particle_io() {
+	std::mt19937 rng(4);
+	auto particles = synthetic_particles(rng, 10, 0.01, 20);
+	auto pixels = pixel_count(particles);
+
+	double ns = time_ns([&] {
+		std::stringstream out;
+		for (auto &p : particles) p.save_to_file(out);
+		sink<size_t> = out.tellp();
+	});
+	report("save_to_file", ns, throughput(particles.size(), pixels, ns));
+
+	auto name = temporary_file("particles");
+	new_batch_file(name.data(), 1);
+	save_batch(name.data(), particles);
+
+	ns = time_ns([&] {
+		std::ifstream file(name, std::ios_base::binary);
+		file.seekg(BatchHeader::V1_SIZE);
+		for (size_t i = 0; i < particles.size(); ++i) sink<int> = Particle::read_from_file(file).width;
+	});
+	report("read_from_file", ns, throughput(particles.size(), pixels, ns));
+
+	ns = time_ns([&] {
+		BatchReader reader(name.data());
+		ParticleView view;
+		Particle p;
+		while (reader.next(view)) {
+			view.decode_into(p);
+			sink<int> = p.width;
+		}
+	});
+	report("read_from_file/batch_reader", ns, throughput(particles.size(), pixels, ns));
+	std::remove(name.data());
+}
+
+// de lijn fits en length_segment op deeltjes van synthetische sporen
+void bench_line_fit() {
+	std::mt19937 rng(5);
+	std::vector<std::vector<Pixel>> tracks;
+	size_t pixels = 0;
+	for (auto &p : synthetic_particles(rng, 10, 0.01, 20)) {
+		if (pixel_count(p) < 5) continue;
+		tracks.push_back(pixels_from_particle(p));
+		pixels += tracks.back().size();
+	}
+
+	// elke SIMD versie die de CPU kan, daarna weer het niveau waarmee bench gestart is
+	auto level = simd_level();
+	for (auto s : {Simd::scalar, Simd::avx2, Simd::avx512}) {
+		if (s > detect_simd()) continue;
+		simd_level() = s;
+		std::string suffix = std::string("/") + simd_name(s);
+
+		auto fit = [&](const char *name, auto f) {
+			double ns = time_ns([&] {
+				for (auto &t : tracks) sink<RealType> = f(t).second;
+			});
+			report(name + suffix, ns, throughput(tracks.size(), pixels, ns));
+		};
+		fit("get_line_from_pixels", [](auto &t) { return get_line_from_pixels(t); });
+		fit("fit_line/closed", [](auto &t) { return fit_line(t, FitMode::closed); });
+		fit("fit_line/hybrid", [](auto &t) { return fit_line(t, FitMode::hybrid); });
+
+		std::vector<Line> lines;
+		for (auto &t : tracks) lines.push_back(get_line_closed_form(t).first);
+		double ns = time_ns([&] {
+			for (size_t i = 0; i < tracks.size(); ++i) sink<RealType> = length_segment(lines[i], tracks[i]);
+		});
+		report("length_segment" + suffix, ns, throughput(tracks.size(), pixels, ns));
+	}
+	simd_level() = level;
+}
+
+/*
+	Particle tegen SparseParticle op lange sporen, waar de bounding box veel groter is dan
+	het aantal hits: uitpakken uit een versie 2 bestand, en de features die over de pixels lopen.
+*/
+void bench_sparse() {
+	std::mt19937 rng(7);
+	auto particles = synthetic_particles(rng, 4, 0.01, 150);
+	auto pixels = pixel_count(particles);
+	size_t cells = 0;
+	for (auto &p : particles) cells += p.area();
+
+	auto name = temporary_file("sparse");
+	new_batch_file(name.data());
+	save_batch(name.data(), particles);
+	auto extra = ", \"bbox_cells\": " + std::to_string(cells);
+
+	auto run = [&](const char *label, auto particle, auto f) {
+		double ns = time_ns([&] {
+			BatchReader reader(name.data());
+			ParticleView view;
+			while (reader.next(view)) {
+				view.decode_into(particle);
+				f(particle);
+			}
+		});
+		report(label, ns, extra + throughput(particles.size(), pixels, ns));
+	};
+	auto features = [](auto &p) {
+		sink<RealType> = pixels_from_particle(p).size() + max_delta(p) + avg_energy(p);
+	};
+	auto nothing = [](auto &p) { sink<int> = p.width; };
+
+	run("decode/dense", Particle(), nothing);
+	run("decode/sparse", SparseParticle(), nothing);
+	run("features/dense", Particle(), features);
+	run("features/sparse", SparseParticle(), features);
+	std::remove(name.data());
+}
+
+// van tekst tot gecodeerde deeltjes, zoals compressor batch zonder het schrijven
+void bench_compress() {
+	std::mt19937 rng(6);
+	Labeler labeler;
+
+	for (double occupancy : {0.001, 0.01, 0.1}) {
+		std::vector<std::string> texts;
+		for (int i = 0; i < 8; ++i) texts.push_back(canvas_to_text(synthetic_canvas(rng, occupancy, 20)));
+
+		size_t particles = 0, pixels = 0;
+		for (auto &text : texts) {
+			SparseFrame hits;
+			parse_sparse_frame(text.data(), text.data() + text.size(), hits);
+			auto found = labeler.find_particles(hits);
+			particles += found.size();
+			pixels += pixel_count(found);
+		}
+
+		std::vector<char> out;
+		double ns = time_ns([&] {
+			out.clear();
+			int64_t time = 0;
+			SparseFrame hits;
+			for (auto &text : texts) {
+				parse_sparse_frame(text.data(), text.data() + text.size(), hits);
+				for (auto &p : labeler.find_particles(hits)) {
+					p.encode_compact(out, time, true);
+					time = p.time_point.time_since_epoch().count();
+				}
+			}
+			sink<size_t> = out.size();
+		});
+		report("compress", ns, ", \"occupancy\": " + std::to_string(occupancy) + ", \"frames\": " + std::to_string(texts.size()) + throughput(particles, pixels, ns));
+	}
+}
+
+std::string metingen = "../metingen";
+
+/*
+	De standaard query van query (zonder --cuts) met de code van query (query.h): van bestand
+	tot hoeken, canvassen en histogrammen, zonder de uitvoer te schrijven. Met beide lijn
+	fits op 1 thread, en met gradient ook met --stream en met alle cores.
+*/
+void bench_query() {
+	struct Variant {
+		std::string name;
+		FitMode mode;
+		bool stream;
+		unsigned threads;
+	};
+	std::vector<Variant> variants = {
+		{"gradient", FitMode::gradient, false, 1},
+		{"hybrid", FitMode::hybrid, false, 1},
+		{"gradient/stream", FitMode::gradient, true, 1},
+		{"gradient/threads=" + std::to_string(ThreadPool::default_thread_count()), FitMode::gradient, false, 0},
+	};
+
+	for (auto file : {"platte_meting", "schuine_meting_uit_oosten", "schuine_meting_uit_westen"}) {
+		auto name = metingen + "/" + file;
+		BatchHeader header;
+		if (!header.load(name.data())) continue;
+
+		size_t particles = 0, pixels = 0;
+		BatchReader reader(name.data());
+		ParticleView view;
+		while (reader.next(view)) {
+			++particles;
+			pixels += view.pixel_count;
+		}
+
+		dispatch_sensor(header.sensor_width, header.sensor_height, [&](auto sensor) {
+			using S = decltype(sensor);
+			for (auto &variant : variants) {
+				QueryOptions options;
+				options.fit_mode = variant.mode;
+				options.stream = variant.stream;
+				options.threads = variant.threads;
+				uint64_t passed = 0;
+				double ns = time_ns([&] {
+					// een nieuw plan per keer, want het past zijn volgorde aan tijdens het lopen
+					QueryPlan plan(FEATURES);
+					for (auto cut : DEFAULT_CUTS) plan.add(cut);
+					BatchReader reader(name.data());
+					auto result = options.aggregate<S>();
+					query_particles(reader, plan, options, options.stream, options.threads, result);
+					passed = result.count;
+				}, 0);
+				report("query/" + variant.name, ns, ", \"file\": \"" + std::string(file) + "\", \"passed\": " + std::to_string(passed) + throughput(particles, pixels, ns));
+			}
+		});
+	}
+}
+
+// schrijft amount rauwe frames [start]_000.txt enzovoort
+int write_frames(const char *start, int amount, double occupancy, int track_length, unsigned seed) {
+	std::mt19937 rng(seed);
+	int digits = std::max<int>(3, std::to_string(amount - 1).size());
+	for (int i = 0; i < amount; ++i) {
+		std::ostringstream name;
+		name << start << '_' << std::setfill('0') << std::setw(digits) << i << ".txt";
+		std::ofstream file(name.str());
+		if (!(file << canvas_to_text(synthetic_canvas(rng, occupancy, track_length)))) {
+			std::cerr << strerror(errno) << ':' << name.str() << '\n';
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// de oude find_particles met een DFS, als referentie
+std::vector<Particle> find_particles_dfs(const CANVAS &arr) {
+	constexpr int VISIT[] = {-1, 1, -WIDTH, WIDTH, -WIDTH-1, -WIDTH+1, WIDTH-1, WIDTH+1};
+	std::vector<Particle> r;
+
+	bool visited[AREA]{};
+	for (int i = 0; i < AREA; ++i) {
+		if (arr[i] && !visited[i]) {
+			int xmin = WIDTH, ymin = HEIGHT, xmax = -1, ymax = -1;
+			std::vector<int> next{i};
+			std::vector<int> included;
+			while (!next.empty()) {
+				int b = next.back();
+				next.pop_back();
+
+				if (b >= 0 && b < AREA && arr[b] && !visited[b]) {
+					included.push_back(b);
+
+					visited[b] = true;
+					int x = b % WIDTH;
+					int y = b / HEIGHT;
+					xmin = std::min(x, xmin);
+					ymin = std::min(y, ymin);
+					xmax = std::max(x, xmax);
+					ymax = std::max(y, ymax);
+
+					for (int v : VISIT) {
+						if (std::abs(v) % WIDTH != 0) {
+							int nx = (x + v) % WIDTH;
+							if (nx < 0 || nx >= WIDTH) {
+								continue;
+							}
+						}
+						next.push_back(b + v);
+					}
+				}
+			}
+			std::sort(included.begin(), included.end());
+
+			r.emplace_back(arr, included, xmin + ymin * WIDTH, xmax - xmin + 1, ymax - ymin + 1);
+		}
+	}
+	return r;
+}
+
+void bench_find_particles() {
+	std::mt19937 rng(2);
+	Labeler labeler;
+
+	for (double occupancy : {0.001, 0.01, 0.1, 0.3}) {
+		auto canvas = synthetic_canvas(rng, occupancy, 20);
+		auto particles = labeler.find_particles(canvas);
+
+		auto extra = ", \"occupancy\": " + std::to_string(occupancy) + ", \"particles\": " + std::to_string(particles.size());
+		report("find_particles/dfs", time_ns([&] { sink<size_t> = find_particles_dfs(canvas).size(); }), extra);
+		report("find_particles", time_ns([&] { sink<size_t> = labeler.find_particles(canvas).size(); }), extra);
+
+		SparseFrame hits;
+		for (int i = 0; i < AREA; ++i) if (canvas[i]) hits.push_back({i, canvas[i]});
+		report("find_particles/sparse", time_ns([&] { sink<size_t> = labeler.find_particles(hits).size(); }), extra);
+	}
+}
+
+// van tekst tot deeltjes, via een CANVAS of via een SparseFrame
+void bench_frame() {
+	std::mt19937 rng(3);
+	Labeler labeler;
+
+	for (double occupancy : {0.001, 0.01, 0.1}) {
+		auto text = canvas_to_text(synthetic_canvas(rng, occupancy, 20));
+		auto begin = text.data(), end = text.data() + text.size();
+
+		auto extra = ", \"occupancy\": " + std::to_string(occupancy);
+		report("frame/dense", time_ns([&] {
+			CANVAS c;
+			parse_canvas(begin, end, c);
+			sink<size_t> = labeler.find_particles(c).size();
+		}), extra);
+		report("frame/sparse", time_ns([&] {
+			SparseFrame hits;
+			parse_sparse_frame(begin, end, hits);
+			sink<size_t> = labeler.find_particles(hits).size();
+		}), extra);
+	}
+}
+
+int main(int argc, char const *argv[]) {
+	if (argc >= 4 && argc <= 7 && !strcmp(argv[1], "frames")) {
+		return write_frames(argv[2], std::stoi(argv[3]), (argc >= 5)? std::stod(argv[4]): 0.01,
+			(argc >= 6)? std::stoi(argv[5]): 20, (argc == 7)? std::stoul(argv[6]): 1);
+	}
+
+	const std::pair<const char *, void (*)()> BENCHMARKS[] = {
+		{"read_canvas", bench_read_canvas},
+		{"find_particles", bench_find_particles},
+		{"frame", bench_frame},
+		{"particle_io", bench_particle_io},
+		{"line_fit", bench_line_fit},
+		{"sparse", bench_sparse},
+		{"compress", bench_compress},
+		{"query", bench_query},
+		{"canvas", bench_canvas},
+	};
+
+	std::vector<const char *> names;
+	for (int i = 1; i < argc; ++i) {
+		if (!strncmp(argv[i], "--metingen=", 11)) metingen = argv[i] + 11;
+		else if (!strncmp(argv[i], "--simd=", 7)) {
+			if (!set_simd_level(argv[i] + 7)) return 1;
+		}
+		else if (!strncmp(argv[i], "--", 2)) {
+			std::cerr << "Unknown option '" << argv[i] << "'\n";
+			return 1;
+		} else names.push_back(argv[i]);
+	}
+
+	std::cout << "{\"name\": \"build\", \"compiler\": \"" << __VERSION__ << "\", \"real_type_bytes\": " << sizeof(RealType) << ", \"simd\": \"" << simd_name(simd_level()) << "\"}" << std::endl;
+	for (auto [name, f] : BENCHMARKS) {
+		bool selected = names.empty();
+		for (auto n : names) selected |= !strcmp(n, name);
+		if (selected) f();
+	}
+	return 0;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "particle.h"
+#include "batch_reader.h"
+
+#include <string>
+#include <vector>
+
+// een canvas binair, zie CanvasLayers
+template <typename S, typename Values>
+inline void write_canvas_binary(const Values &values, const char *dst) {
+	std::vector<char> out = {'C', 'N', 'V', '1'};
+	for (uint16_t size : {uint16_t(S::WIDTH), uint16_t(S::HEIGHT)}) {
+		out.push_back(char(size & 0xff));
+		out.push_back(char(size >> 8));
+	}
+	out.reserve(out.size() + S::AREA);
+	for (int i = 0; i < S::AREA; ++i) Particle::write_varint(out, Particle::zigzag(values[i]));
+	std::ofstream f(dst, std::ios_base::binary);
+	f.write(out.data(), out.size());
+}
+
+/*
+	Leest een canvas van write_canvas_binary in values, met de afmetingen in width en height.
+	false en een melding als het bestand er niet is of niet klopt.
+*/
+inline bool read_canvas_binary(const char *file_name, int &width, int &height, std::vector<int64_t> &values) {
+	MappedFile file(file_name);
+	auto p = file.data(), end = p + file.size();
+	if (file.size() < 8 || std::memcmp(p, "CNV1", 4)) {
+		std::cerr << file_name << " is not a binary canvas\n";
+		return false;
+	}
+	width = read_u16(p + 4);
+	height = read_u16(p + 6);
+	p += 8;
+	values.resize(size_t(width) * height);
+	for (auto &v : values) {
+		uint64_t x;
+		if (!read_varint(p, end, x)) {
+			std::cerr << file_name << " ends before the last pixel\n";
+			return false;
+		}
+		v = int64_t(x >> 1) ^ -int64_t(x & 1);
+	}
+	return true;
+}
+
+enum CanvasMode : unsigned { CANVAS_MAX = 1, CANVAS_SUM = 2, CANVAS_COUNT = 4 };
+constexpr const char *CANVAS_MODE_NAMES[] = {"max", "sum", "count"};
+
+// modes uit een lijst als "max,sum,count"; 0 en een melding als er een onbekende mode in staat
+inline unsigned parse_canvas_modes(const std::string &list) {
+	unsigned result = 0;
+	for (size_t begin = 0; begin <= list.size();) {
+		auto end = std::min(list.find(',', begin), list.size());
+		auto name = list.substr(begin, end - begin);
+		unsigned mode = 0;
+		for (unsigned m = 0; m < 3; ++m) {
+			if (name == CANVAS_MODE_NAMES[m]) mode = 1 << m;
+		}
+		if (!mode) {
+			std::cerr << "Unknown canvas mode '" << name << "'\n";
+			return 0;
+		}
+		result |= mode;
+		begin = end + 1;
+	}
+	return result;
+}
+
+/*
+	Canvassen van veel deeltjes, die in 1 keer over de deeltjes gevuld worden. Per pixel:
+	max		de hoogste waarde, zoals imprint_on_canvas (plaatje)
+	sum		de som van de waardes, als int64 omdat die bij miljoenen deeltjes oploopt (plaatje_som)
+	count	het aantal deeltjes met een hit op die pixel (plaatje_aantal)
+	Alleen de modes die aan staan hebben geheugen. Elke thread kan zijn eigen CanvasLayers
+	vullen; merge voegt ze daarna samen, en dat geeft hetzelfde als alles in 1 keer.
+
+	Naast tekst kan een canvas binair weggeschreven worden, als [naam].cnv:
+		"CNV1", uint16_t width, uint16_t height, daarna per pixel een varint (zigzag)
+	Een pixel van 0 is dan 1 byte, in plaats van 2 in tekst, en er hoeft niets geparsed te worden.
+*/
+template <typename S>
+struct CanvasLayers {
+	static constexpr const char *FILE_NAMES[] = {"plaatje", "plaatje_som", "plaatje_aantal"};
+
+	unsigned modes = 0;
+	std::vector<int> max, count;
+	std::vector<int64_t> sum;
+
+	explicit CanvasLayers(unsigned modes = CANVAS_MAX) : modes(modes) {
+		if (modes & CANVAS_MAX) max.assign(S::AREA, 0);
+		if (modes & CANVAS_SUM) sum.assign(S::AREA, 0);
+		if (modes & CANVAS_COUNT) count.assign(S::AREA, 0);
+	}
+
+	template <typename P>
+	void imprint(const P &p) {
+		for_each_hit(p, [this](int i, int value) {
+			if (modes & CANVAS_MAX) max[i] = std::max(max[i], value);
+			if (modes & CANVAS_SUM) sum[i] += value;
+			if (modes & CANVAS_COUNT) ++count[i];
+		});
+	}
+
+	void merge(const CanvasLayers &other) {
+		if (modes & other.modes & CANVAS_MAX) merge_max(max.data(), other.max.data());
+		if (modes & other.modes & CANVAS_SUM) merge_sum(sum.data(), other.sum.data());
+		if (modes & other.modes & CANVAS_COUNT) merge_sum(count.data(), other.count.data());
+	}
+
+	/*
+		Schrijft de canvassen die aan staan naar [naam].txt, of binair naar [naam].cnv, met
+		suffix achter de naam. Geeft de namen (zonder suffix) terug.
+	*/
+	std::vector<std::string> write(bool binary, const std::string &suffix = "") const {
+		std::vector<std::string> names;
+		for (unsigned m = 0; m < 3; ++m) {
+			if (!(modes & (1 << m))) continue;
+			names.push_back(std::string(FILE_NAMES[m]) + (binary? ".cnv": ".txt"));
+			auto name = names.back() + suffix;
+			if (m == 1) write_values(sum, binary, name.data());
+			else write_values(m == 0? max: count, binary, name.data());
+		}
+		return names;
+	}
+
+	template <typename Values>
+	static void write_values(const Values &values, bool binary, const char *file_name) {
+		if (binary) write_canvas_binary<S>(values, file_name);
+		else write_values_to_file<S>(values, file_name);
+	}
+
+	void save(std::ostream &out) const {
+		out.write(reinterpret_cast<const char*>(&modes), sizeof(modes));
+		out.write(reinterpret_cast<const char*>(max.data()), max.size() * sizeof(int));
+		out.write(reinterpret_cast<const char*>(sum.data()), sum.size() * sizeof(int64_t));
+		out.write(reinterpret_cast<const char*>(count.data()), count.size() * sizeof(int));
+	}
+
+	// false als in niet met CanvasLayers met dezelfde modes begint
+	bool load(std::istream &in) {
+		unsigned saved = 0;
+		if (!in.read(reinterpret_cast<char*>(&saved), sizeof(saved)) || saved != modes) return false;
+		in.read(reinterpret_cast<char*>(max.data()), max.size() * sizeof(int));
+		in.read(reinterpret_cast<char*>(sum.data()), sum.size() * sizeof(int64_t));
+		in.read(reinterpret_cast<char*>(count.data()), count.size() * sizeof(int));
+		return bool(in);
+	}
+
+private:
+	template <typename Function>
+	static void for_each_hit(const SparseParticle &p, Function f) {
+		for (auto &h : p.hits) f(p.start_x + h.x + (p.start_y + h.y) * S::WIDTH, h.value);
+	}
+
+	template <typename Function>
+	static void for_each_hit(const Particle &p, Function f) {
+		for (int y = 0; y < p.height; ++y) {
+			for (int x = 0; x < p.width; ++x) {
+				if (int value = p.data[y * p.width + x]) f(p.start_x + x + (p.start_y + y) * S::WIDTH, value);
+			}
+		}
+	}
+
+	// een vast aantal pixels en geen aliasing, dus de compiler maakt er SIMD van
+	static void merge_max(int *__restrict a, const int *__restrict b) {
+		for (int i = 0; i < S::AREA; ++i) a[i] = std::max(a[i], b[i]);
+	}
+
+	template <typename T>
+	static void merge_sum(T *__restrict a, const T *__restrict b) {
+		for (int i = 0; i < S::AREA; ++i) a[i] += b[i];
+	}
+};
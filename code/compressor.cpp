@@ -1,78 +1,121 @@
 /*
 
 	Compileer met: 
-	g++ -Wall -O2 -std=c++17 -o compressor compressor.cpp particle.cpp
+	g++ -Wall -O2 -std=c++17 -pthread -o compressor compressor.cpp particle.cpp
 
-	Leeg bestand maken:
-	compressor new [bestand]
+	Leeg bestand maken, standaard in de nieuwste versie (2) en voor een sensor van 256 x 256:
+	compressor new [bestand] (versie) (breedte hoogte)
+	Bekende sensoren: 256 x 256, 512 x 512 en 768 x 256; versie 1 kent alleen 256 x 256.
+	batch, auto en watch lezen rauwe frames van de sensor van [gecomprimeerd]. De deeltjes van
+	een frame krijgen de tijd waarop het rauwe bestand voor het laatst veranderd is.
 
 	Deeltjes uit rauwe data bestanden toevoegen aan gecomprimeerde bestand:
 	compressor batch [gecomprimeerd] [data betand beginletters] [aantal] (cijfers)
+	Met --threads=N worden N rauwe bestanden tegelijk ingelezen en gelabeld (0 = alle cores,
+	standaard 1); ze worden op volgorde weggeschreven en het bestand is hetzelfde als met 1.
+	batch stopt bij het eerste bestand dat er niet is.
 
 	Deeltjes uit rauwe data bestanden toevoegen aan gecomprimeerde bestand tijdens meting en rauw verwijderen:
 	compressor auto [gecomprimeerd] [data betand beginletters] [aantal cijfers] [tijdsinterval bestand check in ms] [maximale wachttijd in ms]
 
-	Bestanden toevoegen aan 1 groot bestand
+	Hetzelfde, maar een bestand wordt verwerkt zodra het klaar is met schrijven (inotify, alleen Linux).
+	Inlezen, deeltjes zoeken en wegschrijven gebeuren tegelijk, met [threads] threads voor het zoeken (standaard 2):
+	compressor watch [gecomprimeerd] [data betand beginletters] [aantal cijfers] [maximale wachttijd in ms] (threads)
+	Rauwe bestanden die er bij het starten al staan worden als klaar gezien.
+
+	Bestanden toevoegen aan 1 groot bestand, in de versie van de bestemming
 	compressor append [bestemming] {bestanden...}
+
+	Een bestand omzetten naar een andere versie (standaard de nieuwste):
+	compressor convert [bron] [bestemming] (versie)
+
+	Versie 1 heeft 8 bytes tijd per deeltje en 2 bytes per getal. Versie 2 heeft 1 tijd per
+	frame, varints en een samenvatting per deeltje (aantal pixels, energie, maximum) waarmee
+	query deeltjes kan afkeuren zonder de pixels te lezen. Het is zo'n 30% kleiner.
+	query leest beide versies.
+
+	Opties voor het schrijven naar [gecomprimeerd], voor batch, auto en watch:
+	--flush=N                  schrijf na elke N frames (batch: 64, auto en watch: 1)
+	--sync=never|close|flush   wanneer fsync (batch: never, auto en watch: flush)
+	Rauwe bestanden worden pas verwijderd als hun deeltjes weggeschreven zijn.
+
+	Met --stats=BESTAND schrijven auto en watch elke seconde (--stats-interval=MS) tellers, tijden
+	per stage en hoeveel rauwe bestanden er nog klaar staan in Prometheus tekst naar BESTAND.
+
+	Index met de positie van elk n-de deeltje maken in [gecomprimeerd].idx (standaard n = 64):
+	compressor index [gecomprimeerd] (n)
+	Daarna houden batch, auto en append de index bij.
 */
 
 #include "particle.h"
+#include "batch_reader.h"
+#include "labeling.h"
+#include "pipeline.h"
+#include "batch_writer.h"
+#include "stats.h"
 
 #include <thread>
+#include <atomic>
 #include <chrono>
 #include <sstream>
 #include <iomanip>
 #include <cstring>
 #include <algorithm>
 #include <memory>
+#include <set>
+#include <optional>
 
-decltype(auto) find_particles(const std::string &canvas_file) {
-	constexpr int VISIT[] = {-1, 1, -WIDTH, WIDTH, -WIDTH-1, -WIDTH+1, WIDTH-1, WIDTH+1};
-	std::vector<Particle> r;
-
-	auto arr = read_canvas(canvas_file);
-
-	bool visited[AREA]{};
-	for (int i = 0; i < AREA; ++i) {
-		if (arr[i] && !visited[i]) {
-			int xmin = WIDTH, ymin = HEIGHT, xmax = -1, ymax = -1;
-			std::vector<int> next{i};
-			std::vector<int> included;
-			while (!next.empty()) {
-				int b = next.back();
-				next.pop_back();
-
-				if (b >= 0 && b < AREA && arr[b] && !visited[b]) {
-					included.push_back(b);
-
-					visited[b] = true;
-					int x = b % WIDTH;
-					int y = b / HEIGHT;
-					xmin = std::min(x, xmin);
-					ymin = std::min(y, ymin);
-					xmax = std::max(x, xmax);
-					ymax = std::max(y, ymax);
-
-					for (int v : VISIT) {
-						if (std::abs(v) % WIDTH != 0) {
-							int nx = (x + v) % WIDTH;
-							if (nx < 0 || nx >= WIDTH) {
-								continue;
-							}
-						}
-						next.push_back(b + v);
-					}
-				}
-			}
-			std::sort(included.begin(), included.end());
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-			r.emplace_back(arr, included, xmin + ymin * WIDTH, xmax - xmin + 1, ymax - ymin + 1);
-		}
+IngestStats stats;
+
+template <typename S>
+std::vector<Particle> read_particles(Labeler<S> &labeler, const std::string &canvas_file) {
+	SparseFrame hits;
+	{
+		auto timer = stats.time(IngestStats::read);
+		hits = read_sparse_frame<S>(canvas_file);
 	}
+	auto timer = stats.time(IngestStats::label);
+	return labeler.find_particles(hits);
+}
+
+template <typename S>
+std::vector<Particle> find_particles(const std::string &canvas_file) {
+	static thread_local Labeler<S> labeler;
+	auto r = read_particles(labeler, canvas_file);
 	std::cout << canvas_file << " contains " << r.size() << " particles\n";
 	return r;
 }
 
+// wanneer file_name voor het laatst veranderd is
+Particle::sys_clock::time_point modified(const std::string &file_name) {
+	struct stat st;
+	if (stat(file_name.data(), &st)) return Particle::sys_clock::now();
+	auto since_epoch = std::chrono::seconds(st.st_mtim.tv_sec) + std::chrono::nanoseconds(st.st_mtim.tv_nsec);
+	return Particle::sys_clock::time_point(std::chrono::duration_cast<Particle::sys_clock::duration>(since_epoch));
+}
+
+// schrijft de deeltjes van een rauw bestand dat op time_point klaar was en houdt de stats bij
+bool write_frame(BatchWriter &writer, const std::vector<Particle> &particles, Particle::sys_clock::time_point time_point) {
+	uint64_t size = writer.file_size();
+	bool flushed;
+	{
+		auto timer = stats.time(IngestStats::write);
+		flushed = writer.write(particles);
+	}
+	stats.bytes_written += writer.file_size() - size;
+	stats.lag = std::chrono::duration<double>(Particle::sys_clock::now() - time_point).count();
+	++stats.frames;
+	stats.particles += particles.size();
+	return flushed;
+}
+
 std::string to_string(int x, int n) {
 	std::ostringstream out;
     out << std::setfill('0') << std::setw(n) << x;
@@ -88,8 +131,137 @@ bool does_file_exist(const char *file_name) {
     return f.good();
 }
 
-void compress_batch(const char *dest, const char *data, int amount, int digits) {
+// --flush=N en --sync=never|close|flush, zonder optie kiest elk commando zelf
+struct WriterOptions {
+	std::optional<unsigned> frames_per_flush;
+	std::optional<SyncPolicy> sync;
+
+	BatchWriter open(const char *file_name, unsigned frames_per_flush, SyncPolicy sync) const {
+		return BatchWriter(file_name, this->frames_per_flush.value_or(frames_per_flush), this->sync.value_or(sync));
+	}
+} writer_options;
+
+/*
+	threads threads maken van elke Job met make(job, labeler) de deeltjes van een frame, en 1
+	writer thread geeft die met write door op de volgorde waarin de jobs met push kwamen.
+	Er zijn hoogstens 4 * threads frames tegelijk onderweg.
+
+	Als make of write een exceptie gooit wordt die gemeld en wordt er vanaf dat frame niets
+	meer geschreven; push geeft dan false. De rest van de pipeline loopt gewoon leeg, zodat
+	finish niet blijft wachten op een frame dat nooit komt.
+*/
+template <typename S, typename Job, typename Result>
+class FramePipeline {
+public:
+	template <typename Make, typename Write>
+	FramePipeline(unsigned threads, Make make, Write write) : jobs(2 * std::max(1u, threads)), results(4 * std::max(1u, threads)) {
+		for (unsigned t = 0; t < std::max(1u, threads); ++t) {
+			labelers.emplace_back([this, make] {
+				Labeler<S> labeler;
+				std::pair<long, Job> job;
+				while (jobs.pop(job)) {
+					std::optional<Result> result;
+					try {
+						result = make(job.second, labeler);
+					} catch (const std::exception &e) {
+						std::cerr << "Could not label frame " << job.first << ": " << e.what() << '\n';
+					}
+					results.put(job.first, std::move(result));
+				}
+			});
+		}
+		writer = std::thread([this, write] {
+			while (auto result = results.take()) {
+				if (failed) continue;
+				if (!*result) {
+					failed = true;
+					continue;
+				}
+				try {
+					write(**result);
+				} catch (const std::exception &e) {
+					std::cerr << "Could not write frame: " << e.what() << '\n';
+					failed = true;
+				}
+			}
+		});
+	}
+
+	FramePipeline(const FramePipeline &) = delete;
+	FramePipeline &operator=(const FramePipeline &) = delete;
+
+	~FramePipeline() {
+		finish();
+	}
+
+	// wacht als er al te veel frames onderweg zijn; false als er iets mis ging, zie hierboven
+	bool push(Job job) {
+		if (failed) return false;
+		results.reserve(pushed);
+		jobs.push({pushed, std::move(job)});
+		++pushed;
+		return true;
+	}
+
+	bool ok() const {
+		return !failed;
+	}
+
+	// wacht tot alles wat met push kwam geschreven is
+	void finish() {
+		if (!writer.joinable()) return;
+		jobs.close();
+		for (auto &t : labelers) t.join();
+		results.close(pushed);
+		writer.join();
+	}
+
+private:
+	BoundedQueue<std::pair<long, Job>> jobs;
+	// leeg voor een frame waarvan make een exceptie gooide
+	OrderedBuffer<std::optional<Result>> results;
+	std::vector<std::thread> labelers;
+	std::thread writer;
+	long pushed = 0;
+	std::atomic<bool> failed{false};
+};
+
+/*
+	Alle deeltjes van een frame krijgen de tijd waarop het rauwe bestand geschreven is, en niet
+	die van het labelen. Zo hebben ze bij het opnieuw comprimeren van een oude meting de tijd
+	van de meting, geeft batch met elk aantal threads hetzelfde bestand, en lopen de tijden
+	in het bestand niet terug als watch een later frame eerder gelabeld heeft (seek_time van
+	BatchReader rekent daarop).
+*/
+void set_frame_time(std::vector<Particle> &particles, Particle::sys_clock::time_point time_point) {
+	for (auto &p : particles) p.time_point = time_point;
+}
+
+/*
+	Met threads > 1 worden de rauwe bestanden tegelijk ingelezen en gelabeld en schrijft 1
+	thread ze weg op volgorde van index; het gecomprimeerde bestand is hetzelfde als met 1.
+*/
+template <typename S>
+void compress_batch(const char *dest, const char *data, int amount, int digits, unsigned threads) {
 	std::string file_name_start = std::string(data) + "_";
+	auto writer = writer_options.open(dest, 64, SyncPolicy::never);
+
+	struct Result {
+		std::string file_name;
+		std::vector<Particle> particles;
+	};
+	std::optional<FramePipeline<S, std::string, Result>> pipeline;
+	if (threads > 1) {
+		pipeline.emplace(threads, [](const std::string &file_name, Labeler<S> &labeler) {
+			auto time_point = modified(file_name);
+			Result result{file_name, read_particles(labeler, file_name)};
+			set_frame_time(result.particles, time_point);
+			return result;
+		}, [&writer](const Result &result) {
+			std::cout << result.file_name << " contains " << result.particles.size() << " particles\n";
+			writer.write(result.particles);
+		});
+	}
 
 	for (int i = 0; i < amount; ++i) {
 		auto file_name = file_name_start + to_string(i, digits) + ".txt";
@@ -97,57 +269,321 @@ void compress_batch(const char *dest, const char *data, int amount, int digits)
 			std::cerr << file_name << " does not exist\n";
 			break;
 		}
-		save_batch(dest, find_particles(file_name));
+		if (pipeline) {
+			if (!pipeline->push(file_name)) break;
+			continue;
+		}
+		auto time_point = modified(file_name);
+		auto particles = find_particles<S>(file_name);
+		set_frame_time(particles, time_point);
+		writer.write(particles);
+	}
+	if (pipeline) {
+		pipeline->finish();
+		if (!pipeline->ok()) std::cerr << "Compressing stopped after an error\n";
 	}
 }
 
+// verwijdert de rauwe bestanden pas als hun deeltjes in het gecomprimeerde bestand staan
+class RawFiles {
+public:
+	void add(const std::string &file_name, bool flushed) {
+		pending.push_back(file_name);
+		if (flushed) remove_all();
+		stats.raw_pending = pending.size();
+	}
+
+	void remove_all() {
+		for (auto &file_name : pending) {
+			remove_file(file_name);
+			remove_file(file_name + ".dsc");
+		}
+		pending.clear();
+		stats.raw_pending = 0;
+	}
+
+	// sluit writer en verwijdert de rest alleen als alles weggeschreven is
+	void close(BatchWriter &writer) {
+		if (writer.close()) remove_all();
+		else if (!pending.empty()) std::cerr << "Could not write the last particles, keeping " << pending.size() << " raw files\n";
+	}
+
+private:
+	std::vector<std::string> pending;
+};
+
+template <typename S>
 void auto_compress(const char *dest, const char *data, int digits, int check_interval, int max_time) {
 	std::string file_name_start = std::string(data) + "_";
+	auto writer = writer_options.open(dest, 1, SyncPolicy::flush);
+	RawFiles raw;
+
+	// de bestanden na het huidige die er al staan
+	std::atomic<int> next{0};
+	IngestStats::Publisher publisher(stats, [&] {
+		uint64_t n = 0;
+		while (does_file_exist((file_name_start + to_string(next + n, digits) + ".txt").data())) ++n;
+		return n;
+	});
 
-	for (int i = 0;; ++i) {
+	for (int i = 0;; next = ++i) {
 		auto file_name = file_name_start + to_string(i, digits) + ".txt";
 		auto time_stamp = std::chrono::steady_clock::now();
-		for (int c = 0; !does_file_exist(file_name.data()); c++) {
-			if (time_stamp + std::chrono::milliseconds(max_time) <= std::chrono::steady_clock::now()) {
+		{
+			auto timer = stats.time(IngestStats::wait);
+			for (int c = 0; !does_file_exist(file_name.data()); c++) {
+				if (time_stamp + std::chrono::milliseconds(max_time) <= std::chrono::steady_clock::now()) {
+					std::cerr << "Could not find '" << file_name << "' in max time. Compressing stopped\n";
+					raw.close(writer);
+					return;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(check_interval));
+			}
+		}
+		{
+			auto timer = stats.time(IngestStats::sleep);
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		}
+		auto time_point = modified(file_name);
+		auto particles = find_particles<S>(file_name);
+		set_frame_time(particles, time_point);
+		raw.add(file_name, write_frame(writer, particles, time_point));
+	}
+}
+
+/*
+	Houdt met inotify bij welke rauwe bestanden [beginletters][index].txt klaar zijn met schrijven.
+*/
+class FrameWatcher {
+public:
+	FrameWatcher(const std::string &file_name_start, int digits) : digits(digits) {
+		auto slash = file_name_start.rfind('/');
+		directory = slash == std::string::npos? ".": file_name_start.substr(0, slash + 1);
+		prefix = file_name_start.substr(slash == std::string::npos? 0: slash + 1);
+
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0 || inotify_add_watch(fd, directory.data(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			std::cerr << strerror(errno) << ':' << directory << '\n';
+			return;
+		}
+
+		// pas na het starten van de watch kijken, anders kan er een bestand tussendoor glippen
+		if (auto dir = opendir(directory.data())) {
+			while (auto entry = readdir(dir)) add(entry->d_name);
+			closedir(dir);
+		}
+	}
+
+	FrameWatcher(const FrameWatcher &) = delete;
+	FrameWatcher &operator=(const FrameWatcher &) = delete;
+
+	~FrameWatcher() {
+		if (fd >= 0) close(fd);
+	}
+
+	bool ok() const {
+		return fd >= 0;
+	}
+
+	// aantal frames dat klaar is en nog niet door wait_for is teruggegeven
+	size_t ready_count() const {
+		return ready.size();
+	}
+
+	// wacht tot frame index klaar is, false als dat niet binnen max_time ms gebeurt
+	bool wait_for(long index, int max_time) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(max_time);
+		for (;;) {
+			if (ready.erase(index)) return true;
+
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0) return false;
+
+			pollfd p{fd, POLLIN, 0};
+			if (poll(&p, 1, left) <= 0) continue;
+
+			alignas(inotify_event) char buffer[4096];
+			ssize_t n;
+			while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+				for (char *e = buffer; e < buffer + n;) {
+					auto event = reinterpret_cast<inotify_event *>(e);
+					if (event->len) add(event->name);
+					e += sizeof(inotify_event) + event->len;
+				}
+			}
+		}
+	}
+
+private:
+	int fd = -1;
+	int digits;
+	std::string directory, prefix;
+	std::set<long> ready;
+
+	void add(const std::string &name) {
+		constexpr char EXTENSION[] = ".txt";
+		constexpr size_t EXTENSION_SIZE = sizeof(EXTENSION) - 1;
+		if (name.size() <= prefix.size() + EXTENSION_SIZE || name.compare(0, prefix.size(), prefix)
+			|| name.compare(name.size() - EXTENSION_SIZE, EXTENSION_SIZE, EXTENSION)) return;
+
+		auto number = name.substr(prefix.size(), name.size() - prefix.size() - EXTENSION_SIZE);
+		if (!std::all_of(number.begin(), number.end(), ::isdigit)) return;
+		long index = std::stol(number);
+		if (to_string(index, digits) == number) ready.insert(index);
+	}
+};
+
+/*
+	Pipeline voor compressor watch: deze thread leest de rauwe bestanden in zodra ze klaar zijn,
+	threads labelers zoeken de deeltjes en 1 writer schrijft ze weg op volgorde van index.
+	Een rauw bestand wordt pas verwijderd als zijn deeltjes in het gecomprimeerde bestand staan.
+*/
+template <typename S>
+void watch_compress(const char *dest, const char *data, int digits, int max_time, unsigned threads) {
+	std::string file_name_start = std::string(data) + "_";
+	FrameWatcher watcher(file_name_start, digits);
+	if (!watcher.ok()) return;
+
+	struct Frame {
+		std::string file_name;
+		Particle::sys_clock::time_point time_point;
+		SparseFrame hits;
+	};
+	struct Result {
+		std::string file_name;
+		Particle::sys_clock::time_point time_point;
+		std::vector<Particle> particles;
+	};
+
+	auto batch = writer_options.open(dest, 1, SyncPolicy::flush);
+	RawFiles raw;
+	FramePipeline<S, Frame, Result> pipeline(threads, [](Frame &frame, Labeler<S> &labeler) {
+		auto timer = stats.time(IngestStats::label);
+		Result result{std::move(frame.file_name), frame.time_point, labeler.find_particles(frame.hits)};
+		set_frame_time(result.particles, result.time_point);
+		return result;
+	}, [&batch, &raw](const Result &result) {
+		std::cout << result.file_name << " contains " << result.particles.size() << " particles\n";
+		raw.add(result.file_name, write_frame(batch, result.particles, result.time_point));
+	});
+
+	// klaar volgens de watcher en nog niet gelezen, of gelezen en nog niet weggeschreven
+	std::atomic<uint64_t> ready{0}, read{0};
+	IngestStats::Publisher publisher(stats, [&] {
+		uint64_t written = stats.frames;
+		return ready + read - written;
+	});
+
+	for (long i = 0;; ++i) {
+		auto file_name = file_name_start + to_string(i, digits) + ".txt";
+		{
+			auto timer = stats.time(IngestStats::wait);
+			if (!watcher.wait_for(i, max_time)) {
 				std::cerr << "Could not find '" << file_name << "' in max time. Compressing stopped\n";
-				return;
+				break;
 			}
-			std::this_thread::sleep_for(std::chrono::milliseconds(check_interval));
 		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(500));
-		save_batch(dest, find_particles(file_name));
-		remove_file(file_name);
-		remove_file(file_name + ".dsc");
+		ready = watcher.ready_count();
+		Frame frame{file_name, modified(file_name), {}};
+		{
+			auto timer = stats.time(IngestStats::read);
+			frame.hits = read_sparse_frame<S>(file_name);
+		}
+		++read;
+		if (!pipeline.push(std::move(frame))) break;
 	}
+
+	pipeline.finish();
+	if (!pipeline.ok()) std::cerr << "Compressing stopped after an error\n";
+	raw.close(batch);
+}
+
+// roept f(S{}) aan met de sensor van het batch bestand dest
+template <typename Function>
+bool with_sensor_of(const char *dest, Function f) {
+	BatchHeader header;
+	return header.load(dest) && dispatch_sensor(header.sensor_width, header.sensor_height, f);
 }
 
 int main(int argc, char const *argv[]) {
+	std::vector<const char *> args;
+	std::string stats_file;
+	int stats_interval = 1000;
+	unsigned batch_threads = 1;
+	for (int i = 0; i < argc; ++i) {
+		if (!strncmp(argv[i], "--flush=", 8)) writer_options.frames_per_flush = std::stoul(argv[i] + 8);
+		else if (!strcmp(argv[i], "--sync=never")) writer_options.sync = SyncPolicy::never;
+		else if (!strcmp(argv[i], "--sync=close")) writer_options.sync = SyncPolicy::close;
+		else if (!strcmp(argv[i], "--sync=flush")) writer_options.sync = SyncPolicy::flush;
+		else if (!strncmp(argv[i], "--stats=", 8)) stats_file = argv[i] + 8;
+		else if (!strncmp(argv[i], "--stats-interval=", 17)) stats_interval = std::stoi(argv[i] + 17);
+		else if (!strncmp(argv[i], "--threads=", 10)) batch_threads = std::stoi(argv[i] + 10);
+		else if (!strncmp(argv[i], "--", 2)) {
+			std::cerr << "Unknown option '" << argv[i] << "'\n";
+			return 1;
+		} else args.push_back(argv[i]);
+	}
+	argc = args.size();
+	argv = args.data();
+	stats.publish_to(stats_file, stats_interval);
+
 	if (argc >= 2) {
 		if (!strcmp(argv[1], "new")) {
-			if (argc == 3) {
-				new_batch_file(argv[2]);
-				return 0;
+			if (argc == 3 || argc == 4 || argc == 6) {
+				int version = (argc >= 4)? std::stoi(argv[3]): BatchHeader::LATEST;
+				int width = (argc == 6)? std::stoi(argv[4]): SingleChip::WIDTH, height = (argc == 6)? std::stoi(argv[5]): SingleChip::HEIGHT;
+				if (!dispatch_sensor(width, height, [](auto) {})) return 1;
+				return new_batch_file(argv[2], version, width, height)? 0: 1;
 			}
 		} else if (!strcmp(argv[1], "batch")) {
 			if (argc == 5 || argc == 6) {
-				compress_batch(argv[2], argv[3], std::stoi(argv[4]), (argc == 6)? std::stoi(argv[5]): strlen(argv[4]));
-				return 0;
+				return with_sensor_of(argv[2], [&](auto sensor) {
+					compress_batch<decltype(sensor)>(argv[2], argv[3], std::stoi(argv[4]), (argc == 6)? std::stoi(argv[5]): strlen(argv[4]),
+						batch_threads? batch_threads: ThreadPool::default_thread_count());
+				})? 0: 1;
 			}
 		} else if (!strcmp(argv[1], "auto")) {
 			if (argc == 7) {
-				auto_compress(argv[2], argv[3], std::stoi(argv[4]), std::stoi(argv[5]), std::stoi(argv[6]));
-				return 0;
+				return with_sensor_of(argv[2], [&](auto sensor) {
+					auto_compress<decltype(sensor)>(argv[2], argv[3], std::stoi(argv[4]), std::stoi(argv[5]), std::stoi(argv[6]));
+				})? 0: 1;
+			}
+		} else if (!strcmp(argv[1], "watch")) {
+			if (argc == 6 || argc == 7) {
+				return with_sensor_of(argv[2], [&](auto sensor) {
+					watch_compress<decltype(sensor)>(argv[2], argv[3], std::stoi(argv[4]), std::stoi(argv[5]), (argc == 7)? std::stoi(argv[6]): 2);
+				})? 0: 1;
 			}
 		} else if (!strcmp(argv[1], "append")) {
 			if (argc >= 3) {
 				auto dest = argv[2];
 
-				for (int i = 3; i < argc; ++i) append_batch(dest, argv[i]);
+				bool ok = append_batch(dest, std::vector<const char *>(argv + 3, argv + argc));
 
 				std::ifstream f(dest);
 				std::cout << dest << " now contains " << get_batch_size(f) << " particles\n";
 				f.close();
 
+				return ok? 0: 1;
+			}
+		} else if (!strcmp(argv[1], "convert")) {
+			if (argc == 4 || argc == 5) {
+				int version = (argc == 5)? std::stoi(argv[4]): BatchHeader::LATEST;
+				// de sensor blijft die van de bron
+				BatchHeader source;
+				if (!source.load(argv[2]) || !new_batch_file(argv[3], version, source.sensor_width, source.sensor_height)) return 1;
+				if (!append_batch(argv[3], {argv[2]})) return 1;
+
+				std::ifstream src(argv[2], std::ios::binary | std::ios::ate), dst(argv[3], std::ios::binary | std::ios::ate);
+				auto src_size = src.tellg(), dst_size = dst.tellg();
+				std::cout << argv[3] << " contains " << get_batch_size(dst) << " particles, " << dst_size << " bytes instead of " << src_size << '\n';
+				return 0;
+			}
+		} else if (!strcmp(argv[1], "index")) {
+			if (argc == 3 || argc == 4) {
+				auto index = BatchIndex::build(argv[2], (argc == 4)? std::max(1, std::stoi(argv[3])): BatchIndex::DEFAULT_STRIDE);
+				index.save(argv[2]);
+				std::cout << argv[2] << " contains " << index.count << " particles, indexed every " << index.stride << '\n';
 				return 0;
 			}
 		}
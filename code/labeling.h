@@ -0,0 +1,164 @@
+#pragma once
+
+#include "particle.h"
+
+#include <numeric>
+
+/*
+	Connected-component labeling met 8-connectiviteit, op runs.
+
+	Een run is een stuk van een rij met alleen pixels die niet 0 zijn. Runs worden
+	met union-find samengevoegd met de runs van de rij erboven die ze raken, ook schuin.
+	De wortel van een component is altijd zijn eerste run, dus de deeltjes komen in
+	de volgorde van hun eerste pixel en de pixels van een deeltje staan op volgorde.
+*/
+template <typename S = SingleChip>
+class Labeler {
+public:
+	static constexpr int WIDTH = S::WIDTH;
+	static constexpr int HEIGHT = S::HEIGHT;
+
+	std::vector<Particle> find_particles(const Canvas<S> &arr) {
+		start();
+		for (int y = 0; y < HEIGHT; ++y) {
+			const int *row = arr.data() + y * WIDTH;
+			for (int x = 0; x < WIDTH;) {
+				// bijna alles is 0, dus eerst 8 pixels tegelijk overslaan
+				while (x + 8 <= WIDTH && !(row[x] | row[x + 1] | row[x + 2] | row[x + 3] | row[x + 4] | row[x + 5] | row[x + 6] | row[x + 7])) x += 8;
+				if (x == WIDTH) break;
+				if (!row[x]) {
+					++x;
+					continue;
+				}
+				int x0 = x;
+				while (x < WIDTH && row[x]) ++x;
+				add_run(y, x0, x, y * WIDTH + x0);
+			}
+		}
+		return build(arr.data());
+	}
+
+	// hetzelfde, maar de tijd hangt af van het aantal hits in plaats van de grootte van de sensor
+	std::vector<Particle> find_particles(const SparseFrame &hits) {
+		start();
+		values.resize(hits.size());
+		for (size_t i = 0, n = hits.size(); i < n;) {
+			size_t begin = i;
+			int y = hits[i].index / WIDTH, x0 = hits[i].index % WIDTH;
+			values[i] = hits[i].value;
+			for (++i; i < n && hits[i].index == hits[i - 1].index + 1 && hits[i].index % WIDTH; ++i) values[i] = hits[i].value;
+			add_run(y, x0, x0 + int(i - begin), begin);
+		}
+		return build(values.data());
+	}
+
+private:
+	struct Run {
+		int y, x0, x1;	// pixels [x0, x1) van rij y
+		size_t value;	// waar de waarde van pixel x0 staat
+	};
+
+	std::vector<Run> runs;
+	std::vector<int> parent;
+	std::vector<int> values;
+	std::vector<int> label;
+	std::vector<int> first, last, pixel_count, included, included_values;
+
+	// runs [previous_begin, previous_end) zijn de runs van rij previous_y
+	size_t previous_begin = 0, previous_end = 0, current_begin = 0;
+	int previous_y = -1, current_y = -1;
+
+	void start() {
+		runs.clear();
+		parent.clear();
+		previous_begin = previous_end = current_begin = 0;
+		previous_y = current_y = -1;
+	}
+
+	int find(int i) {
+		while (parent[i] != i) i = parent[i] = parent[parent[i]];
+		return i;
+	}
+
+	void unite(int a, int b) {
+		a = find(a);
+		b = find(b);
+		if (a < b) parent[b] = a;
+		else if (b < a) parent[a] = b;
+	}
+
+	// runs moeten op volgorde van y en dan x komen
+	void add_run(int y, int x0, int x1, size_t value) {
+		if (y != current_y) {
+			previous_y = current_y;
+			previous_begin = current_begin;
+			previous_end = current_begin = runs.size();
+			current_y = y;
+		}
+
+		int id = runs.size();
+		runs.push_back({y, x0, x1, value});
+		parent.push_back(id);
+		if (previous_y != y - 1) return;
+
+		// runs die helemaal links liggen raken deze en volgende runs niet meer
+		while (previous_begin < previous_end && runs[previous_begin].x1 < x0) ++previous_begin;
+		for (auto j = previous_begin; j < previous_end && runs[j].x0 <= x1; ++j) unite(id, j);
+	}
+
+	std::vector<Particle> build(const int *value) {
+		int n = runs.size(), components = 0;
+		label.assign(n, -1);
+		pixel_count.clear();
+
+		struct Box {
+			int xmin, ymin, xmax, ymax;
+		};
+		std::vector<Box> boxes;
+
+		for (int i = 0; i < n; ++i) {
+			int root = find(i);
+			if (label[root] < 0) {
+				label[root] = components++;
+				boxes.push_back({WIDTH, HEIGHT, -1, -1});
+				pixel_count.push_back(0);
+			}
+			int c = label[i] = label[root];
+			auto &r = runs[i];
+			auto &b = boxes[c];
+			b.xmin = std::min(b.xmin, r.x0);
+			b.xmax = std::max(b.xmax, r.x1 - 1);
+			b.ymin = std::min(b.ymin, r.y);
+			b.ymax = std::max(b.ymax, r.y);
+			pixel_count[c] += r.x1 - r.x0;
+		}
+
+		// alle pixels per component achter elkaar, in rasterorde, als index in de bounding box
+		first.assign(components + 1, 0);
+		std::partial_sum(pixel_count.begin(), pixel_count.end(), first.begin() + 1);
+		last.assign(first.begin(), first.end() - 1);
+		included.resize(first.back());
+		included_values.resize(first.back());
+		for (int i = 0; i < n; ++i) {
+			auto &r = runs[i];
+			int &at = last[label[i]];
+			auto &b = boxes[label[i]];
+			int row = (r.y - b.ymin) * (b.xmax - b.xmin + 1) - b.xmin;
+			for (int x = r.x0; x < r.x1; ++x, ++at) {
+				included[at] = row + x;
+				included_values[at] = value[r.value + x - r.x0];
+			}
+		}
+
+		// alle deeltjes van een frame krijgen dezelfde tijd
+		auto now = Particle::sys_clock::now();
+		std::vector<Particle> result;
+		result.reserve(components);
+		for (int c = 0; c < components; ++c) {
+			auto &b = boxes[c];
+			result.emplace_back(included.data() + first[c], included_values.data() + first[c], pixel_count[c], b.xmin, b.ymin, b.xmax - b.xmin + 1, b.ymax - b.ymin + 1);
+			result.back().time_point = now;
+		}
+		return result;
+	}
+};
@@ -0,0 +1,388 @@
+#pragma once
+
+#include "particle.h"
+#include "batch_reader.h"
+#include "line_kernels.h"
+
+#include <cmath>
+#include <numeric>
+
+/*
+	Het fitten van een lijn door de pixels van een deeltje, en de features die daaruit volgen.
+*/
+
+template <typename T>
+constexpr T sign(T x) {
+	if (x > 0) return 1;
+	if (x < 0) return -1;
+	return 0;
+}
+
+struct Vec2 {
+	RealType x{}, y{};
+
+	Vec2(RealType x, RealType y) : x(x), y(y) {}
+	Vec2() = default;
+
+	RealType dist2() const {
+		return x * x + y * y;
+	}
+
+	RealType dist() const {
+		return std::sqrt(dist2());
+	}
+
+	Vec2 operator+(const Vec2 &o) const {
+		return {x + o.x, y + o.y};
+	}
+
+	Vec2 operator-(const Vec2 &o) const {
+		return {x - o.x, y - o.y};
+	}
+};
+
+struct Line {
+	RealType a{}, b{}, c{};
+
+	Line(RealType a, RealType b, RealType c=1): a(a), b(b), c(c) {}
+	Line() = default;
+	Line(Vec2 p1, Vec2 p2): Line(
+			p2.y - p1.y,
+			p1.x - p2.x,
+			p1.x * p2.y - p2.x * p1.y
+		) {}
+
+	RealType dist2() const {
+		return a * a + b * b;
+	}
+
+	RealType dist() const {
+		return std::sqrt(dist2());
+	}
+
+	void norm() {
+		operator/=(dist());
+	}
+
+	RealType angle() const {
+		return std::atan(-a / b) / 3.141592 * 180;
+	}
+
+	Vec2 parametic_t0() const {
+		auto d = dist2();
+		return {c * (a + b) / d, c * (b - a) / d};
+	}
+
+	Vec2 parametic_offset(RealType t) const {
+		return {-b * t, a * t};
+	}
+
+	Vec2 parametic(RealType t) const {
+		return parametic_offset(t) + parametic_t0();
+	}
+
+	RealType projection(const Vec2 &p) const {
+		return (p.y * a - p.x * b + c) / dist2();
+	}
+
+	Line &operator+=(const Line &o) {
+		a += o.a;
+		b += o.b;
+		c += o.c;
+		return *this;
+	}
+
+	Line &operator-=(const Line &o) {
+		a -= o.a;
+		b -= o.b;
+		c -= o.c;
+		return *this;
+	}
+
+	Line &operator*=(RealType x) {
+		a *= x;
+		b *= x;
+		c *= x;
+		return *this;
+	}
+
+	Line &operator/=(RealType x) {
+		return this->operator*=(1 / x);
+	}
+
+	Line operator*(RealType x) const {
+		return {a*x, b*x, c*x};
+	}
+
+	void print() const {
+		std::cout << a << "x + " << b << "y = " << c << '\n';
+	}
+};
+
+struct Pixel {
+	Vec2 pos{};
+	RealType w{};
+
+	Pixel(Vec2 p, RealType w) : pos(p), w(w) {}
+};
+
+inline std::vector<Pixel> pixels_from_particle(const Particle &p) {
+	std::vector<Pixel> result;
+	int n = 0;
+	for (auto x : p.data) n += x != 0;
+	auto avg = RealType(std::accumulate(p.data.begin(), p.data.end(), 0)) / RealType(n);
+	for (int i = 0; i < p.width * p.height; ++i) {
+		if (p.data[i]) result.emplace_back(Vec2{RealType(i % p.width), RealType(i / p.width)}, RealType(p.data[i]) / avg);
+	}
+	return result;
+}
+
+// hetzelfde, in dezelfde volgorde, zonder over de nullen van de bounding box te lopen
+inline std::vector<Pixel> pixels_from_particle(const SparseParticle &p) {
+	std::vector<Pixel> result;
+	result.reserve(p.hits.size());
+	int total = 0;
+	for (auto &h : p.hits) total += h.value;
+	auto avg = RealType(total) / RealType(p.hits.size());
+	for (auto &h : p.hits) result.emplace_back(Vec2{RealType(h.x), RealType(h.y)}, RealType(h.value) / avg);
+	return result;
+}
+
+inline RealType score(const Line &line, const PixelBuffer &pixels) {
+	return max_residual_kernel(pixels, line.a, line.b, line.c) / RealType(pixels.size()) / line.dist2();
+}
+
+inline RealType score(const Line &line, const std::vector<Pixel> &pixels) {
+	static thread_local PixelBuffer buffer;
+	buffer.assign(pixels);
+	return score(line, buffer);
+}
+
+inline Line score_gradient(const Line &l, const Pixel &p, RealType d2) {
+	RealType C = (-l.c + l.a * p.pos.x + l.b * p.pos.y);
+	return {
+		p.w * C * (-l.a * C + p.pos.x * d2),
+		p.w * C * (-l.b * C + p.pos.y * d2),
+		p.w * -C * d2,
+	};
+}
+
+inline std::pair<Line, RealType> get_line_from_pixels(const std::vector<Pixel> &pixels, int iterations=10000, RealType gamma=0.001) {
+	static thread_local PixelBuffer buffer;
+	buffer.assign(pixels);
+
+	Line result(pixels.front().pos, pixels.back().pos);
+	result.norm();
+
+	RealType n = RealType(pixels.size());
+	for (int i = 0; i < iterations; ++i) {
+		auto d2 = result.dist2();
+
+		// de som van score_gradient over de pixels
+		RealType g[3] = {};
+		gradient_kernel(buffer, result.a, result.b, result.c, d2, g);
+		Line gradient(g[0], g[1], g[2]);
+
+		result -= gradient * (2 * gamma / (n * d2 * d2));
+		result.norm();
+	}
+
+	return {result, score(result, buffer)};
+}
+
+/*
+	Gewogen momenten van de pixels rond het zwaartepunt (mx, my).
+	Hiermee zijn de fout en de gradient van get_line_from_pixels in O(1) uit te rekenen.
+*/
+struct Moments {
+	RealType w{}, mx{}, my{}, xx{}, xy{}, yy{};
+
+	explicit Moments(const std::vector<Pixel> &pixels) {
+		for (auto &p : pixels) {
+			w += p.w;
+			mx += p.w * p.pos.x;
+			my += p.w * p.pos.y;
+		}
+		mx /= w;
+		my /= w;
+
+		for (auto &p : pixels) {
+			auto dx = p.pos.x - mx, dy = p.pos.y - my;
+			xx += p.w * dx * dx;
+			xy += p.w * dx * dy;
+			yy += p.w * dy * dy;
+		}
+	}
+
+	// som van score_gradient over alle pixels
+	Line gradient(const Line &l, RealType d2) const {
+		auto c = l.c - l.a * mx - l.b * my;
+		auto C2 = l.a * l.a * xx + 2 * l.a * l.b * xy + l.b * l.b * yy + c * c * w;
+		auto Cx = l.a * xx + l.b * xy - c * w * mx;
+		auto Cy = l.a * xy + l.b * yy - c * w * my;
+		return {
+			-l.a * C2 + Cx * d2,
+			-l.b * C2 + Cy * d2,
+			c * w * d2,
+		};
+	}
+};
+
+/*
+	Dezelfde gradient descent als get_line_from_pixels, maar met de gradient uit de momenten.
+	Stopt eerder zodra een stap de lijn niet meer verandert.
+*/
+inline std::pair<Line, RealType> get_line_from_moments(const std::vector<Pixel> &pixels, int iterations=10000, RealType gamma=0.001) {
+	Moments m(pixels);
+	Line result(pixels.front().pos, pixels.back().pos);
+	result.norm();
+
+	RealType n = RealType(pixels.size());
+	for (int i = 0; i < iterations; ++i) {
+		auto d2 = result.dist2();
+		auto previous = result;
+
+		result -= m.gradient(result, d2) * (2 * gamma / (n * d2 * d2));
+		result.norm();
+
+		if (result.a == previous.a && result.b == previous.b && result.c == previous.c) break;
+	}
+
+	return {result, score(result, pixels)};
+}
+
+/*
+	Gesloten vorm van dezelfde fit: de gewogen total least squares lijn.
+	De normaal is de eigenvector bij de kleinste eigenwaarde van de gewogen covariantiematrix.
+*/
+inline Line get_line_closed_form(const Moments &m, const Line &start) {
+	auto theta = std::atan2(2 * m.xy, m.xx - m.yy) / 2;
+	Line result(-std::sin(theta), std::cos(theta));
+	result.c = result.a * m.mx + result.b * m.my;
+
+	// zelfde orientatie als de startlijn van de gradient descent
+	if (result.a * start.a + result.b * start.b < 0) result *= -1;
+	return result;
+}
+
+inline std::pair<Line, RealType> get_line_closed_form(const std::vector<Pixel> &pixels) {
+	Line start(pixels.front().pos, pixels.back().pos);
+	auto result = get_line_closed_form(Moments(pixels), start);
+	return {result, score(result, pixels)};
+}
+
+/*
+	Rond het minimum is een stap van get_line_from_pixels lineair in (hoek, c).
+	Geeft de kleinste en grootste eigenwaarde van die stap terug: de traagste richting
+	krimpt per stap met een factor (1 - 2 * gamma * mu_min), en bij 2 * gamma * mu_max >= 1
+	gaat de snelste richting slingeren.
+*/
+inline std::pair<RealType, RealType> gradient_descent_rates(const Moments &m, const Line &line) {
+	auto spread = 2 * std::hypot((m.xx - m.yy) / 2, m.xy) / m.w;
+	auto along = -line.b * m.mx + line.a * m.my;
+
+	auto trace = spread + along * along + 1;
+	auto disc = std::sqrt(std::max(trace * trace / 4 - spread, RealType(0)));
+	return {trace / 2 - disc, trace / 2 + disc};
+}
+
+enum class FitMode {
+	gradient,	// get_line_from_pixels, zoals het altijd was
+	closed,		// alleen de gesloten vorm
+	hybrid,		// gesloten vorm waar de gradient descent convergeert, anders gradient descent
+};
+
+inline std::pair<Line, RealType> fit_line(const std::vector<Pixel> &pixels, FitMode mode) {
+	switch (mode) {
+	case FitMode::gradient:
+		return get_line_from_pixels(pixels);
+	case FitMode::closed:
+		return get_line_closed_form(pixels);
+	case FitMode::hybrid:
+		break;
+	}
+
+	constexpr int ITERATIONS = 10000;
+	constexpr RealType GAMMA = 0.001;
+
+	Moments m(pixels);
+	Line start(pixels.front().pos, pixels.back().pos);
+	auto line = get_line_closed_form(m, start);
+	auto [mu_min, mu_max] = gradient_descent_rates(m, line);
+
+	// slingert: alleen de originele volgorde van optellen geeft hetzelfde antwoord
+	if (2 * GAMMA * mu_max >= 1) return get_line_from_pixels(pixels, ITERATIONS, GAMMA);
+	// zeker geconvergeerd tot op ~1e-7 van de beginafwijking, en ver genoeg van slingeren
+	// dat de gradient descent ook vanaf een slechte startlijn niet vastloopt
+	if (2 * GAMMA * ITERATIONS * mu_min >= 15 && 2 * GAMMA * mu_max < .5) return {line, score(line, pixels)};
+	return get_line_from_moments(pixels, ITERATIONS, GAMMA);
+}
+
+inline int max_delta(const Particle &p) {
+	std::vector<RealType> sorted;
+	sorted.reserve(p.data.size());
+	for (auto i = 0; i < p.area(); ++i) sorted.push_back(p.data[i]);
+	std::sort(sorted.begin(), sorted.end());
+	std::vector<int> delta(sorted.size());
+	std::adjacent_difference(sorted.begin(), sorted.end(), delta.begin());
+	return *std::max_element(delta.begin() + (delta.end() - delta.begin()) / 2, delta.end());
+}
+
+/*
+	Hetzelfde als max_delta van het uitgepakte deeltje. Daar staan na het sorteren eerst alle
+	nullen van de bounding box; die geven verschil 0, en de eerste waarde daarna verschilt
+	met 0. Alleen de verschillen vanaf de helft van de bounding box tellen.
+*/
+inline int max_delta(const SparseParticle &p) {
+	std::vector<int> sorted;
+	sorted.reserve(p.hits.size());
+	for (auto &h : p.hits) sorted.push_back(h.value);
+	std::sort(sorted.begin(), sorted.end());
+
+	int n = p.area(), zeros = n - int(sorted.size()), from = n / 2;
+	int result = 0;
+	for (int j = std::max(0, from - zeros); j < int(sorted.size()); ++j) {
+		result = std::max(result, sorted[j] - (j? sorted[j - 1]: 0));
+	}
+	return result;
+}
+
+inline RealType avg_energy(const Particle &p) {
+	int pixels = 0, total = 0;
+	for (auto i = 0; i < p.area(); ++i) {
+		if (p.data[i]) ++pixels;
+		total += p.data[i];
+	}
+
+	return RealType(total) / RealType(pixels);
+}
+
+inline RealType avg_energy(const SparseParticle &p) {
+	int total = 0;
+	for (auto &h : p.hits) total += h.value;
+	return RealType(total) / RealType(p.hits.size());
+}
+
+inline RealType avg_energy(const ParticleView &p) {
+	return RealType(p.energy()) / RealType(p.pixel_count);
+}
+
+inline RealType length_segment(const Line &line, const std::vector<Pixel> &p) {
+	static thread_local PixelBuffer buffer;
+	buffer.assign(p);
+	std::vector<RealType> t(p.size());
+	int n = p.size();
+	// t[i] = line.projection(p[i].pos)
+	projections_kernel(buffer, line.a, line.b, line.c, line.dist2(), t.data());
+	std::vector<int> sorted(p.size());
+	std::iota(sorted.begin(), sorted.end(), 0);
+	std::stable_sort(sorted.begin(), sorted.end(), [&t] (auto a, auto b) {
+		return t[a] < t[b];
+	});
+	return (line.parametic_offset((t[sorted[0]] * 10  * p[sorted[0]].w   + t[sorted[1]]   * p[sorted[1]].w)   / (10 * p[sorted[0]].w   + p[sorted[1]].w))
+		  - line.parametic_offset((t[sorted[n-1]] * 10 * p[sorted[n-1]].w + t[sorted[n-2]] * p[sorted[n-2]].w) / (10 * p[sorted[n-1]].w + p[sorted[n-2]].w))).dist();
+}
+
+inline RealType vertical_angle(RealType length) {
+	return std::atan(5.48571428571 / length) * 180 / 3.141592;
+}
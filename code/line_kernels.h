@@ -0,0 +1,278 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+/*
+	Met -DQUERY_REAL_FLOAT rekent de lijn fit in float in plaats van double. Dat is sneller
+	(twee keer zoveel getallen per SIMD instructie) maar geeft andere hoeken; controleer met
+	query --check-fit of de verschillen klein genoeg zijn voor wat je wil meten.
+*/
+#ifdef QUERY_REAL_FLOAT
+using RealType = float;
+#else
+using RealType = double;
+#endif
+
+/*
+	De binnenste lussen van de lijn fit over de pixels van een deeltje als struct of arrays,
+	met SIMD kernels voor AVX2 en AVX-512 en een gewone versie voor alle andere CPU's.
+	Welke gebruikt wordt, wordt 1 keer bij het starten gekozen (zie simd_level). Standaard is
+	dat AVX2 als de CPU dat kan: de meeste sporen hebben maar zo'n 20 pixels, en dan laten 8
+	doubles per keer een langere rest over dan 4 (bench line_fit: AVX-512 was 20% langzamer).
+
+	Alle versies rekenen per pixel precies dezelfde bewerkingen in dezelfde volgorde uit,
+	en tellen de gradient in de volgorde van de pixels op. De uitkomst is dus tot op de
+	laatste bit gelijk, ook na 10000 stappen gradient descent. Daarom staat fp-contract
+	uit: een fused multiply-add rondt anders af dan een vermenigvuldiging en optelling.
+*/
+enum class Simd { scalar, avx2, avx512 };
+
+inline const char *simd_name(Simd s) {
+	switch (s) {
+	case Simd::scalar: return "scalar";
+	case Simd::avx2: return "avx2";
+	case Simd::avx512: return "avx512";
+	}
+	return "";
+}
+
+// het hoogste niveau dat de CPU kan
+inline Simd detect_simd() {
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx512f")) return Simd::avx512;
+	if (__builtin_cpu_supports("avx2")) return Simd::avx2;
+#endif
+	return Simd::scalar;
+}
+
+// de kernels die gebruikt worden; mag alleen naar een niveau dat de CPU heeft
+inline Simd &simd_level() {
+	static Simd level = std::min(detect_simd(), Simd::avx2);
+	return level;
+}
+
+// zet simd_level op auto, scalar, avx2 of avx512; false en een melding als de CPU dat niet kan
+inline bool set_simd_level(const char *name) {
+	if (!strcmp(name, "auto")) {
+		simd_level() = std::min(detect_simd(), Simd::avx2);
+		return true;
+	}
+	for (auto s : {Simd::scalar, Simd::avx2, Simd::avx512}) {
+		if (strcmp(name, simd_name(s))) continue;
+		if (s > detect_simd()) {
+			std::cerr << "This CPU does not support " << name << '\n';
+			return false;
+		}
+		simd_level() = s;
+		return true;
+	}
+	std::cerr << "Unknown SIMD level '" << name << "'\n";
+	return false;
+}
+
+// de pixels van een deeltje: posities x, y en gewichten w
+struct PixelBuffer {
+	std::vector<RealType> x, y, w;
+
+	size_t size() const {
+		return x.size();
+	}
+
+	template <typename Pixels>
+	void assign(const Pixels &pixels) {
+		x.clear();
+		y.clear();
+		w.clear();
+		for (auto &p : pixels) {
+			x.push_back(p.pos.x);
+			y.push_back(p.pos.y);
+			w.push_back(p.w);
+		}
+	}
+};
+
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+namespace line_kernels {
+
+// de gradient van 1 pixel, zoals score_gradient: (w * C) * (-a * C + x * d2) enzovoort
+template <typename T>
+inline void gradient_terms(T x, T y, T w, T a, T b, T c, T d2, T &ga, T &gb, T &gc) {
+	T C = -c + a * x + b * y;
+	T wC = w * C;
+	ga = wC * (-a * C + x * d2);
+	gb = wC * (-b * C + y * d2);
+	gc = wC * -d2;
+}
+
+template <int BYTES>
+struct Vector {
+	typedef RealType type __attribute__((vector_size(BYTES)));
+	static constexpr int LANES = BYTES / sizeof(RealType);
+
+	// geen vector als return waarde, dan hangt de ABI niet van de target af
+	__attribute__((always_inline)) static void load(type &v, const RealType *p) {
+		std::memcpy(&v, p, sizeof(v));
+	}
+};
+
+/*
+	Som van de gradients van alle pixels. De gradients worden met LANES pixels tegelijk
+	uitgerekend, maar 1 voor 1 opgeteld, want de volgorde van optellen moet gelijk blijven.
+*/
+template <int BYTES>
+__attribute__((always_inline)) inline void gradient(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *g) {
+	using V = Vector<BYTES>;
+	constexpr int N = V::LANES;
+	size_t n = p.size(), i = 0;
+	RealType ga = g[0], gb = g[1], gc = g[2];
+	for (; i + N <= n; i += N) {
+		typename V::type x, y, w;
+		V::load(x, &p.x[i]);
+		V::load(y, &p.y[i]);
+		V::load(w, &p.w[i]);
+		auto C = -c + a * x + b * y;
+		auto wC = w * C;
+		typename V::type ta = wC * (-a * C + x * d2), tb = wC * (-b * C + y * d2), tc = wC * -d2;
+		for (int k = 0; k < N; ++k) {
+			ga += ta[k];
+			gb += tb[k];
+			gc += tc[k];
+		}
+	}
+	for (; i < n; ++i) {
+		RealType ta, tb, tc;
+		gradient_terms(p.x[i], p.y[i], p.w[i], a, b, c, d2, ta, tb, tc);
+		ga += ta;
+		gb += tb;
+		gc += tc;
+	}
+	g[0] = ga;
+	g[1] = gb;
+	g[2] = gc;
+}
+
+// grootste (a * x + b * y - c)^2, met dezelfde vergelijking als std::max(x * x, C)
+template <int BYTES>
+__attribute__((always_inline)) inline RealType max_residual(const PixelBuffer &p, RealType a, RealType b, RealType c) {
+	using V = Vector<BYTES>;
+	constexpr int N = V::LANES;
+	size_t n = p.size(), i = 0;
+	typename V::type m{};
+	for (; i + N <= n; i += N) {
+		typename V::type x, y;
+		V::load(x, &p.x[i]);
+		V::load(y, &p.y[i]);
+		auto r = a * x + b * y - c;
+		auto rr = r * r;
+		m = rr < m? m: rr;
+	}
+	RealType C = 0;
+	for (int k = 0; k < N; ++k) C = std::max(m[k], C);
+	for (; i < n; ++i) {
+		auto r = a * p.x[i] + b * p.y[i] - c;
+		C = std::max(r * r, C);
+	}
+	return C;
+}
+
+// t[i] = (y * a - x * b + c) / d2, zoals Line::projection
+template <int BYTES>
+__attribute__((always_inline)) inline void projections(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *t) {
+	using V = Vector<BYTES>;
+	constexpr int N = V::LANES;
+	size_t n = p.size(), i = 0;
+	for (; i + N <= n; i += N) {
+		typename V::type x, y;
+		V::load(x, &p.x[i]);
+		V::load(y, &p.y[i]);
+		typename V::type r = (y * a - x * b + c) / d2;
+		std::memcpy(t + i, &r, sizeof(r));
+	}
+	for (; i < n; ++i) t[i] = (p.y[i] * a - p.x[i] * b + c) / d2;
+}
+
+inline void gradient_scalar(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *g) {
+	gradient<sizeof(RealType)>(p, a, b, c, d2, g);
+}
+
+inline RealType max_residual_scalar(const PixelBuffer &p, RealType a, RealType b, RealType c) {
+	return max_residual<sizeof(RealType)>(p, a, b, c);
+}
+
+inline void projections_scalar(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *t) {
+	projections<sizeof(RealType)>(p, a, b, c, d2, t);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline void gradient_avx2(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *g) {
+	gradient<32>(p, a, b, c, d2, g);
+}
+
+__attribute__((target("avx2"))) inline RealType max_residual_avx2(const PixelBuffer &p, RealType a, RealType b, RealType c) {
+	return max_residual<32>(p, a, b, c);
+}
+
+__attribute__((target("avx2"))) inline void projections_avx2(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *t) {
+	projections<32>(p, a, b, c, d2, t);
+}
+
+__attribute__((target("avx512f"))) inline void gradient_avx512(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *g) {
+	gradient<64>(p, a, b, c, d2, g);
+}
+
+__attribute__((target("avx512f"))) inline RealType max_residual_avx512(const PixelBuffer &p, RealType a, RealType b, RealType c) {
+	return max_residual<64>(p, a, b, c);
+}
+
+__attribute__((target("avx512f"))) inline void projections_avx512(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *t) {
+	projections<64>(p, a, b, c, d2, t);
+}
+#endif
+
+} // namespace line_kernels
+
+#pragma GCC pop_options
+
+/*
+	Telt de gradients van alle pixels bij g = {a, b, c} op, voor de lijn a x + b y = c met d2 = a^2 + b^2.
+*/
+inline void gradient_kernel(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *g) {
+	using namespace line_kernels;
+#if defined(__x86_64__) || defined(__i386__)
+	switch (simd_level()) {
+	case Simd::avx512: return gradient_avx512(p, a, b, c, d2, g);
+	case Simd::avx2: return gradient_avx2(p, a, b, c, d2, g);
+	case Simd::scalar: break;
+	}
+#endif
+	gradient_scalar(p, a, b, c, d2, g);
+}
+
+inline RealType max_residual_kernel(const PixelBuffer &p, RealType a, RealType b, RealType c) {
+	using namespace line_kernels;
+#if defined(__x86_64__) || defined(__i386__)
+	switch (simd_level()) {
+	case Simd::avx512: return max_residual_avx512(p, a, b, c);
+	case Simd::avx2: return max_residual_avx2(p, a, b, c);
+	case Simd::scalar: break;
+	}
+#endif
+	return max_residual_scalar(p, a, b, c);
+}
+
+inline void projections_kernel(const PixelBuffer &p, RealType a, RealType b, RealType c, RealType d2, RealType *t) {
+	using namespace line_kernels;
+#if defined(__x86_64__) || defined(__i386__)
+	switch (simd_level()) {
+	case Simd::avx512: return projections_avx512(p, a, b, c, d2, t);
+	case Simd::avx2: return projections_avx2(p, a, b, c, d2, t);
+	case Simd::scalar: break;
+	}
+#endif
+	projections_scalar(p, a, b, c, d2, t);
+}
@@ -1,37 +1,70 @@
 #include "particle.h"
+#include "batch_reader.h"
+#include "batch_writer.h"
 
 void save_batch(const char *file_name, const std::vector<Particle> &particles) {
-	std::fstream file;
-	file.open(file_name, std::ios_base::out | std::ios_base::binary | std::ios_base::in);
+	BatchWriter(file_name).write(particles);
+}
 
-	set_batch_size(file, get_batch_size(file) + particles.size());
+bool BatchHeader::load(const char *file_name) {
+	*this = BatchHeader{};
+	std::ifstream file(file_name, std::ios_base::binary);
+	if (!file) return true;
 
-	file.seekp(0, std::ios::end);
+	char data[MAX_SIZE];
+	file.read(data, sizeof(data));
+	auto n = file.gcount();
+	if (!n || parse(data, n)) return true;
+	std::cerr << file_name << " is not a batch file of a known version\n";
+	return false;
+}
 
-	for (auto &p : particles) {
-		p.save_to_file(file);
-		//p->print();
+bool new_batch_file(const char *file_name, int version, int sensor_width, int sensor_height) {
+	if (version < 1 || version > BatchHeader::LATEST) {
+		std::cerr << "unknown version " << version << '\n';
+		return false;
 	}
+	auto header = BatchHeader::of_version(version);
+	if (version == 1 && (sensor_width != SingleChip::WIDTH || sensor_height != SingleChip::HEIGHT)) {
+		std::cerr << "version 1 can only store a sensor of " << SingleChip::WIDTH << " x " << SingleChip::HEIGHT << " pixels\n";
+		return false;
+	}
+	header.sensor_width = sensor_width;
+	header.sensor_height = sensor_height;
 
-	file.close();
-}
-
-void new_batch_file(const char *file_name) {
-	std::ofstream file;
-	file.open(file_name);
-	set_batch_size(file, 0);
-	file.close();
+	std::ofstream file(file_name, std::ios_base::binary);
+	auto bytes = header.encode();
+	file.write(bytes.data(), bytes.size());
+	return true;
 }
 
-void append_batch(const char *destination, const char *source) {
-	std::fstream  dst(destination, std::ios_base::out | std::ios_base::binary | std::ios_base::in);
-	std::ifstream src(source, std::ios::binary);
-
-	set_batch_size(dst, get_batch_size(dst) + get_batch_size(src));
+// met 1 BatchWriter voor alle bronnen, dan wordt destination maar 1 keer geopend
+bool append_batch(const char *destination, const std::vector<const char *> &sources) {
+	BatchWriter dst(destination);
+	if (!dst.ok()) return false;
 
-	dst.seekp(0, std::ios::end);
+	bool ok = true;
+	for (auto source : sources) {
+		BatchReader src(source);
+		if (!src.ok()) {
+			ok = false;
+			continue;
+		}
+		if (!dst.header().same_sensor(src.header())) {
+			std::cerr << source << " is of a sensor of " << src.header().sensor_width << " x " << src.header().sensor_height
+				<< " pixels, " << destination << " of " << dst.header().sensor_width << " x " << dst.header().sensor_height << '\n';
+			ok = false;
+			continue;
+		}
 
-	auto buf = src.rdbuf();
-	buf->pubseekpos(sizeof(uint32_t));
-	dst << buf;
-}
\ No newline at end of file
+		ParticleView view;
+		Particle p;
+		while (src.next(view)) {
+			view.decode_into(p);
+			dst.add(p);
+		}
+		// een bron die midden in een deeltje ophoudt
+		if (src.index() != src.header().count) ok = false;
+	}
+	return dst.close() && ok;
+}
@@ -1,39 +1,131 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include <fstream>
 #include <iostream>
 #include <chrono>
 #include <array>
 #include <algorithm>
 #include <memory>
+#include <memory_resource>
+#include <charconv>
+#include <cstring>
+#include <cstdio>
+
+/*
+	De afmetingen van een sensor in pixels. Code die ervan afhangt krijgt de sensor als
+	template parameter, zodat alle index rekenwerk met constanten gebeurt.
+*/
+template <int W, int H>
+struct Sensor {
+	static constexpr int WIDTH = W;
+	static constexpr int HEIGHT = H;
+	static constexpr int AREA = W * H;
+
+	static constexpr bool touches_border(int start_x, int start_y, int width, int height) {
+		return start_x == 0 || start_y == 0 || start_x + width >= WIDTH || start_y + height >= HEIGHT;
+	}
+};
+
+using SingleChip = Sensor<256, 256>;
+using Quad = Sensor<512, 512>;		// 2 x 2 chips
+using Stitched = Sensor<768, 256>;	// 3 chips naast elkaar
+
+/*
+	Roept f(S{}) aan met de sensor S die width x height groot is.
+	False als er geen sensor met die afmetingen is.
+*/
+template <typename Function>
+bool dispatch_sensor(int width, int height, Function f) {
+	auto attempt = [&](auto sensor) {
+		using S = decltype(sensor);
+		if (width != S::WIDTH || height != S::HEIGHT) return false;
+		f(sensor);
+		return true;
+	};
+	if (attempt(SingleChip{}) || attempt(Quad{}) || attempt(Stitched{})) return true;
+	std::cerr << "unknown sensor of " << width << " x " << height << " pixels\n";
+	return false;
+}
 
-constexpr int WIDTH = 256;
-constexpr int HEIGHT = 256;
-constexpr int AREA = WIDTH * HEIGHT;
-using CANVAS = std::array<int, AREA>;
+// elke waarde van een frame van sensor S
+template <typename S>
+struct Canvas : std::array<int, S::AREA> {};
+
+// de standaard sensor, voor code die maar 1 sensor kent
+constexpr int WIDTH = SingleChip::WIDTH;
+constexpr int HEIGHT = SingleChip::HEIGHT;
+constexpr int AREA = SingleChip::AREA;
+using CANVAS = Canvas<SingleChip>;
+
+/*
+	Allocator voor de pixels van een deeltje uit een std::pmr::memory_resource, bijvoorbeeld een
+	arena voor alle deeltjes van een batch. Anders dan std::pmr::polymorphic_allocator gaat de
+	resource mee bij move assignment, zodat p.data = Particle::Pixels(n, 0, arena) werkt.
+	Een kopie gebruikt altijd de gewone heap, dus een kopie mag langer leven dan de arena.
+*/
+template <typename T>
+struct PixelAllocator {
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	std::pmr::memory_resource *memory = std::pmr::get_default_resource();
+
+	PixelAllocator() = default;
+	PixelAllocator(std::pmr::memory_resource *memory) : memory(memory) {}
+
+	template <typename U>
+	PixelAllocator(const PixelAllocator<U> &other) : memory(other.memory) {}
+
+	T *allocate(size_t n) {
+		return static_cast<T *>(memory->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *p, size_t n) {
+		memory->deallocate(p, n * sizeof(T), alignof(T));
+	}
+
+	PixelAllocator select_on_container_copy_construction() const {
+		return {};
+	}
+
+	template <typename U>
+	bool operator==(const PixelAllocator<U> &other) const {
+		return memory == other.memory || *memory == *other.memory;
+	}
+
+	template <typename U>
+	bool operator!=(const PixelAllocator<U> &other) const {
+		return !(*this == other);
+	}
+};
 
 struct Particle {
 	typedef std::chrono::system_clock sys_clock;
 
+	// de waardes worden ook in een batch bestand als uint16_t opgeslagen
+	using Pixel = uint16_t;
+	using Pixels = std::vector<Pixel, PixelAllocator<Pixel>>;
+
 	sys_clock::time_point time_point = sys_clock::now();
-	std::vector<int> data{};
+	Pixels data{};
 	int width{};
 	int height{};
 	int start_x{};
 	int start_y{};
 
-	Particle(const CANVAS &canvas, const std::vector<int> &included, int from, int width, int height) : data(width * height, 0), width(width), height(height), start_x(from % WIDTH), start_y(from / WIDTH) {
-		int i_index = 0;
-		for (int y = 0; y < height; ++y) {
-			int h_from = from + y * WIDTH;
-			for (int x = 0; x < width; ++x) {
-				int c_index = h_from + x;
-				if (i_index < (int)included.size() && included[i_index] == c_index) {
-					data[y * width + x] = canvas[c_index];
-					++i_index;
-				}
-			}
+	// indexes zijn de indexen in de bounding box van de pixels van het deeltje, values hun waardes
+	Particle(const int *indexes, const int *values, int count, int start_x, int start_y, int width, int height) : data(width * height, 0), width(width), height(height), start_x(start_x), start_y(start_y) {
+		for (int i = 0; i < count; ++i) data[indexes[i]] = values[i];
+	}
+
+	// included zijn de indexen in canvas van de pixels van het deeltje, op volgorde
+	template <typename S>
+	Particle(const Canvas<S> &canvas, const std::vector<int> &included, int from, int width, int height) : data(width * height, 0), width(width), height(height), start_x(from % S::WIDTH), start_y(from / S::WIDTH) {
+		for (int c_index : included) {
+			data[(c_index / S::WIDTH - start_y) * width + c_index % S::WIDTH - start_x] = canvas[c_index];
 		}
 	}
 
@@ -43,47 +135,55 @@ struct Particle {
 		return width * height;
 	}
 
+	template <typename S = SingleChip>
 	bool touches_border() const {
-		return start_x == 0 || start_y == 0 || start_x + width >= WIDTH || start_y + height >= HEIGHT;
+		return S::touches_border(start_x, start_y, width, height);
 	}
 
-	void imprint_on_canvas(CANVAS &canvas) const {
+	template <typename S>
+	void imprint_on_canvas(Canvas<S> &canvas) const {
 		for (int y = 0; y < height; ++y) {
 			for (int x = 0; x < width; ++x) {
-				auto &c_i = canvas[start_x + x + (start_y + y) * WIDTH];
-				c_i = std::max(c_i, data[y * width + x]);
+				auto &c_i = canvas[start_x + x + (start_y + y) * S::WIDTH];
+				c_i = std::max<int>(c_i, data[y * width + x]);
 			}
 		}
 	}
 
-	template <typename T>
-	void save_to_file(T &file) const {
+	// de stukken met alleen nullen in data, als (index, lengte)
+	std::vector<std::pair<int, int>> zero_runs() const {
 		std::vector<std::pair<int, int>> zeros;
-		std::vector<int> included;
 		int z_count = 0;
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
-				int index = y * width + x;
-				if (data[index]) {
-					if (z_count) zeros.emplace_back(index - z_count, z_count);
-					z_count = 0;
-					included.push_back(data[index]);
-				} else ++z_count;
-			}
+		for (int index = 0; index < width * height; ++index) {
+			if (data[index]) {
+				if (z_count) zeros.emplace_back(index - z_count, z_count);
+				z_count = 0;
+			} else ++z_count;
 		}
 
 		if (z_count) zeros.emplace_back(width * height - z_count, z_count);
+		return zeros;
+	}
 
-		auto write = [&file](int x) {
-			//std::cout << x << '\n';
-			file.seekp(0, std::ios_base::end);
-			auto y = (uint16_t)x;
-			file.write(reinterpret_cast<char*>(&y), 2);
-		};
+	// zet het deeltje in het formaat van een versie 1 batch bestand achter out
+	void encode(std::vector<char> &out) const {
+		auto zeros = zero_runs();
+		int nonzero = width * height;
+		for (auto &x : zeros) nonzero -= x.second;
 
-		file.seekp(0, std::ios_base::end);
 		auto t = time_point.time_since_epoch().count();
-		file.write(reinterpret_cast<char*>(&t), sizeof t);
+		size_t at = out.size();
+		out.resize(at + sizeof(t) + 2 * (5 + 2 * zeros.size() + nonzero));
+		char *p = out.data() + at;
+
+		std::memcpy(p, &t, sizeof t);
+		p += sizeof t;
+
+		auto write = [&p](int x) {
+			auto y = (uint16_t)x;
+			std::memcpy(p, &y, 2);
+			p += 2;
+		};
 
 		write(start_x);
 		write(start_y);
@@ -102,6 +202,71 @@ struct Particle {
 		}
 	}
 
+	/*
+		Hetzelfde voor versie 2. Alles is een varint: de tijd als verschil met previous_time
+		(de tijd van het deeltje ervoor, dus 0 voor deeltjes van hetzelfde frame), de stukken
+		nullen als (pixels sinds het vorige stuk, lengte) en de pixels zelf.
+		Met summary staan na de bounding box ook het aantal pixels, de energie, de hoogste
+		waarde en het aantal bytes van de rest, zodat een lezer die rest kan overslaan.
+	*/
+	void encode_compact(std::vector<char> &out, sys_clock::rep previous_time, bool summary) const {
+		auto zeros = zero_runs();
+
+		write_varint(out, zigzag(time_point.time_since_epoch().count() - previous_time));
+		write_varint(out, start_x);
+		write_varint(out, start_y);
+		write_varint(out, width);
+		write_varint(out, height);
+
+		size_t payload = out.size();
+		write_varint(out, zeros.size());
+		int end = 0;
+		for (auto &x : zeros) {
+			write_varint(out, x.first - end);
+			write_varint(out, x.second);
+			end = x.first + x.second;
+		}
+
+		int hits = 0, energy = 0, max = 0;
+		for (auto x : data) {
+			if (!x) continue;
+			write_varint(out, x);
+			++hits;
+			energy += x;
+			max = std::max<int>(max, x);
+		}
+
+		if (summary) {
+			std::vector<char> head;
+			write_varint(head, hits);
+			write_varint(head, energy);
+			write_varint(head, max);
+			write_varint(head, out.size() - payload);
+			out.insert(out.begin() + payload, head.begin(), head.end());
+		}
+	}
+
+	static void write_varint(std::vector<char> &out, uint64_t x) {
+		while (x >= 0x80) {
+			out.push_back(char(x | 0x80));
+			x >>= 7;
+		}
+		out.push_back(char(x));
+	}
+
+	static uint64_t zigzag(int64_t x) {
+		return (uint64_t(x) << 1) ^ uint64_t(x >> 63);
+	}
+
+	template <typename T>
+	void save_to_file(T &file) const {
+		std::vector<char> buffer;
+		encode(buffer);
+		file.seekp(0, std::ios_base::end);
+		file.write(buffer.data(), buffer.size());
+	}
+
+	// leest een deeltje van een versie 1 batch bestand
 	static Particle read_from_file(std::ifstream &file) {
 		auto next = [&file]() {
 			uint16_t x;
@@ -174,30 +339,213 @@ struct Particle {
 	}
 };
 
+/*
+	Een deeltje als lijst van de pixels die niet 0 zijn, op volgorde van index in de
+	bounding box, in plaats van de hele bounding box. Voor een lang schuin spoor is dat
+	veel kleiner, en alles wat over de pixels loopt kost dan tijd per hit in plaats van
+	per pixel van de bounding box.
+*/
+struct SparseParticle {
+	using sys_clock = Particle::sys_clock;
+
+	// x en y zijn ten opzichte van (start_x, start_y)
+	struct Hit {
+		uint16_t x, y;
+		Particle::Pixel value;
+	};
+	using Hits = std::vector<Hit, PixelAllocator<Hit>>;
+
+	sys_clock::time_point time_point = sys_clock::now();
+	Hits hits{};
+	int width{};
+	int height{};
+	int start_x{};
+	int start_y{};
+
+	SparseParticle() = default;
 
-inline CANVAS read_canvas(const std::string &file_name) {
-	std::ifstream file;
-	file.open(file_name.data());
-	CANVAS arr;
-	for (int i = 0; i < AREA; ++i) {
-		file >> arr[i];
+	explicit SparseParticle(const Particle &p) : time_point(p.time_point), width(p.width), height(p.height), start_x(p.start_x), start_y(p.start_y) {
+		for (int i = 0; i < p.area(); ++i) {
+			if (p.data[i]) hits.push_back({uint16_t(i % width), uint16_t(i / width), p.data[i]});
+		}
 	}
-	file.close();
-	arr[(91-1) * WIDTH + 70-1] = 0;
+
+	int area() const {
+		return width * height;
+	}
+
+	template <typename S = SingleChip>
+	bool touches_border() const {
+		return S::touches_border(start_x, start_y, width, height);
+	}
+
+	template <typename S>
+	void imprint_on_canvas(Canvas<S> &canvas) const {
+		for (auto &h : hits) {
+			auto &c_i = canvas[start_x + h.x + (start_y + h.y) * S::WIDTH];
+			c_i = std::max<int>(c_i, h.value);
+		}
+	}
+
+	Particle to_particle() const {
+		Particle p;
+		p.time_point = time_point;
+		p.width = width;
+		p.height = height;
+		p.start_x = start_x;
+		p.start_y = start_y;
+		p.data.assign(area(), 0);
+		for (auto &h : hits) p.data[h.y * width + h.x] = h.value;
+		return p;
+	}
+
+	void print() const {
+		to_particle().print();
+	}
+};
+
+
+// een pixel van een frame die niet 0 is
+struct Hit {
+	int index;
+	int value;
+};
+
+// de pixels van een frame die niet 0 zijn, op volgorde van index
+using SparseFrame = std::vector<Hit>;
+
+// de pixel die altijd aan staat en daarom wordt genegeerd, -1 als een sensor die niet heeft
+template <typename S>
+constexpr int HOT_PIXEL = -1;
+
+template <>
+constexpr int HOT_PIXEL<SingleChip> = (91-1) * SingleChip::WIDTH + 70-1;
+
+/*
+	Leest de getallen van een rauw frame uit de tekst [begin, end) en roept hit(index, waarde)
+	aan voor elk getal dat niet 0 is. Geeft het aantal gelezen getallen terug.
+*/
+template <typename S, typename Function>
+inline int parse_frame(const char *p, const char *end, Function hit) {
+	constexpr int AREA = S::AREA;
+
+	auto is_space = [](char c) {
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+	};
+
+	// bijna alle pixels zijn 0, dus "0 0 0 0 " wordt in een keer herkend
+	constexpr char ZEROS[8] = {'0', ' ', '0', ' ', '0', ' ', '0', ' '};
+
+	int i = 0;
+	while (i < AREA) {
+		while (p != end && is_space(*p)) ++p;
+		if (p == end) break;
+
+		while (i + 4 <= AREA && end - p >= 8 && !std::memcmp(p, ZEROS, 8)) {
+			i += 4;
+			p += 8;
+		}
+		if (i == AREA || p == end || is_space(*p)) continue;
+
+		if (*p == '0' && (p + 1 == end || is_space(p[1]))) {
+			++i;
+			++p;
+			continue;
+		}
+
+		int value;
+		auto [next, ec] = std::from_chars(p, end, value);
+		if (ec != std::errc()) break;
+		if (value) hit(i, value);
+		p = next;
+		++i;
+	}
+	return i;
+}
+
+/*
+	Leest de getallen van een rauw frame uit de tekst [begin, end) in arr, zonder de HOT_PIXEL.
+	Geeft het aantal gelezen getallen terug; de rest van arr wordt 0.
+*/
+template <typename S>
+inline int parse_canvas(const char *p, const char *end, Canvas<S> &arr) {
+	std::fill(arr.begin(), arr.end(), 0);
+	return parse_frame<S>(p, end, [&arr](int i, int value) {
+		if (i != HOT_PIXEL<S>) arr[i] = value;
+	});
+}
+
+// hetzelfde als parse_canvas, maar alleen de pixels die niet 0 zijn
+template <typename S = SingleChip>
+inline int parse_sparse_frame(const char *p, const char *end, SparseFrame &hits) {
+	hits.clear();
+	return parse_frame<S>(p, end, [&hits](int i, int value) {
+		if (i != HOT_PIXEL<S>) hits.push_back({i, value});
+	});
+}
+
+// leest een heel bestand in text, false als het niet te openen is
+inline bool read_text_file(const std::string &file_name, std::vector<char> &text) {
+	auto file = std::fopen(file_name.data(), "rb");
+	if (!file) return false;
+	std::fseek(file, 0, SEEK_END);
+	text.resize(std::max(0l, std::ftell(file)));
+	std::fseek(file, 0, SEEK_SET);
+	text.resize(std::fread(text.data(), 1, text.size(), file));
+	std::fclose(file);
+	return true;
+}
+
+template <typename S = SingleChip>
+inline Canvas<S> read_canvas(const std::string &file_name) {
+	static thread_local std::vector<char> text;
+
+	Canvas<S> arr{};
+	int n = 0;
+	if (read_text_file(file_name, text)) n = parse_canvas(text.data(), text.data() + text.size(), arr);
+
+	if (n != S::AREA) std::cerr << file_name << " contains only " << n << " of " << S::AREA << " values\n";
 	return arr;
 }
 
-inline void write_canvas_to_file(const CANVAS &c, const char *dst) {
-	std::ofstream f(dst);
+template <typename S = SingleChip>
+inline SparseFrame read_sparse_frame(const std::string &file_name) {
+	static thread_local std::vector<char> text;
+
+	SparseFrame hits;
+	int n = 0;
+	if (read_text_file(file_name, text)) n = parse_sparse_frame<S>(text.data(), text.data() + text.size(), hits);
+
+	if (n != S::AREA) std::cerr << file_name << " contains only " << n << " of " << S::AREA << " values\n";
+	return hits;
+}
+
+// de waardes van een canvas als tekst, een rij per regel; values mag elk type getal hebben
+template <typename S, typename Values>
+inline void write_values_to_file(const Values &values, const char *dst) {
+	std::string text;
+	text.reserve(4 * S::AREA);
+	char number[24];
 	int i = 0;
-	for (int y = 0; y < HEIGHT; ++y) {
-		for (int x = 0; x < WIDTH; ++x) f << c[i++] << (x + 1 == WIDTH? '\n': ' ');
+	for (int y = 0; y < S::HEIGHT; ++y) {
+		for (int x = 0; x < S::WIDTH; ++x) {
+			auto end = std::to_chars(number, number + sizeof(number), values[i++]).ptr;
+			text.append(number, end);
+			text += x + 1 == S::WIDTH? '\n': ' ';
+		}
 	}
+	std::ofstream f(dst);
+	f.write(text.data(), text.size());
 }
 
-template <typename T, typename Function>
-inline CANVAS convert_to_canvas(const std::vector<T> &vec, Function f) {
-	CANVAS c{};
+template <typename S>
+inline void write_canvas_to_file(const Canvas<S> &c, const char *dst) {
+	write_values_to_file<S>(c, dst);
+}
+
+template <typename S = SingleChip, typename T, typename Function>
+inline Canvas<S> convert_to_canvas(const std::vector<T> &vec, Function f) {
+	Canvas<S> c{};
 
 	for (const auto &t : vec) {
 		auto x = f(t);
@@ -207,42 +555,124 @@ inline CANVAS convert_to_canvas(const std::vector<T> &vec, Function f) {
 	return c;
 }
 
-template <typename T>
-uint32_t get_batch_size(T &file) {
-	uint32_t n;
-	file.seekg(0, std::ios_base::beg);
-	file.read(reinterpret_cast<char*>(&n), sizeof(n));
-	return n;
-}
+/*
+	Een batch bestand begint met een header en daarna de deeltjes.
+
+	Versie 1: uint32_t count, daarna de deeltjes met Particle::encode.
+	Versie 2: "MUON", uint16_t version, uint16_t header_size, uint32_t count, uint32_t flags,
+	int64_t last_time (tijd van het laatste deeltje), uint16_t sensor_width, uint16_t sensor_height,
+	uint64_t data_end (waar het laatste getelde deeltje ophoudt), daarna de deeltjes met
+	Particle::encode_compact.
+	Met de flag SUMMARY heeft elk deeltje een samenvatting; nieuwe bestanden hebben die altijd.
+	Versie 1 en versie 2 headers van 24 bytes (zonder sensor) zijn van een SingleChip.
+	Versie 1 en versie 2 headers van minder dan 36 bytes hebben geen data_end.
+
+	Een versie 1 bestand met precies 1313166669 ("MUON") deeltjes wordt dus niet herkend.
+*/
+struct BatchHeader {
+	static constexpr char MAGIC[4] = {'M', 'U', 'O', 'N'};
+	static constexpr uint16_t LATEST = 2;
+	static constexpr size_t V1_SIZE = sizeof(uint32_t);
+	static constexpr size_t V2_SIZE = 36;
+	static constexpr size_t MAX_SIZE = V2_SIZE;
+
+	static constexpr uint32_t SUMMARY = 1;
+
+	uint16_t version = LATEST;
+	uint16_t size = V2_SIZE;
+	uint32_t count = 0;
+	uint32_t flags = SUMMARY;
+	int64_t last_time = 0;
+	uint16_t sensor_width = SingleChip::WIDTH;
+	uint16_t sensor_height = SingleChip::HEIGHT;
+	uint64_t data_end = V2_SIZE;
+
+	static BatchHeader of_version(uint16_t version) {
+		BatchHeader h;
+		h.version = version;
+		h.size = version == 1? V1_SIZE: V2_SIZE;
+		h.flags = version == 1? 0: SUMMARY;
+		h.data_end = h.size;
+		return h;
+	}
 
-template <typename T>
-void set_batch_size(T &file, uint32_t x) {
-	file.seekp(0, std::ios_base::beg);
-	file.write(reinterpret_cast<char*>(&x), sizeof(x));
-}
+	bool has_data_end() const {
+		return size >= 36;
+	}
 
-void new_batch_file(const char *file_name);
+	bool same_sensor(const BatchHeader &other) const {
+		return sensor_width == other.sensor_width && sensor_height == other.sensor_height;
+	}
 
-void save_batch(const char *file_name, const std::vector<Particle> &particles);
+	// de header van een bestaand bestand; een bestand dat leeg is of er niet is krijgt de standaard header
+	bool load(const char *file_name);
+
+	// false als data niet met een header begint die we kennen
+	bool parse(const char *data, size_t length) {
+		constexpr size_t V2_MIN_SIZE = 24;
+		if (length >= V2_MIN_SIZE && !std::memcmp(data, MAGIC, 4)) {
+			*this = BatchHeader{};
+			std::memcpy(&version, data + 4, 2);
+			std::memcpy(&size, data + 6, 2);
+			if (version != 2 || size < V2_MIN_SIZE || length < size) return false;
+			std::memcpy(&count, data + 8, 4);
+			std::memcpy(&flags, data + 12, 4);
+			std::memcpy(&last_time, data + 16, 8);
+			if (size >= 28) {
+				std::memcpy(&sensor_width, data + 24, 2);
+				std::memcpy(&sensor_height, data + 26, 2);
+			}
+			if (size >= 36) std::memcpy(&data_end, data + 28, 8);
+			return true;
+		}
+		if (length < V1_SIZE) return false;
+		*this = of_version(1);
+		std::memcpy(&count, data, 4);
+		return true;
+	}
+
+	// vanaf hier staat alles wat verandert als er deeltjes bij komen
+	size_t count_offset() const {
+		return version == 1? 0: 8;
+	}
 
-void append_batch(const char *destination, const char *source);
+	std::vector<char> encode() const {
+		std::vector<char> out(size);
+		if (version == 1) {
+			std::memcpy(out.data(), &count, 4);
+			return out;
+		}
+		std::memcpy(out.data(), MAGIC, 4);
+		std::memcpy(out.data() + 4, &version, 2);
+		std::memcpy(out.data() + 6, &size, 2);
+		std::memcpy(out.data() + 8, &count, 4);
+		std::memcpy(out.data() + 12, &flags, 4);
+		std::memcpy(out.data() + 16, &last_time, 8);
+		if (size >= 28) {
+			std::memcpy(out.data() + 24, &sensor_width, 2);
+			std::memcpy(out.data() + 26, &sensor_height, 2);
+		}
+		if (size >= 36) std::memcpy(out.data() + 28, &data_end, 8);
+		return out;
+	}
+};
 
-template <typename Tuple = std::tuple<Particle>, typename Function>
-inline std::vector<Tuple> read_batch_filtered(const char *file_name, Function f) {
-	std::ifstream file;
-	file.open(file_name, std::ios_base::in | std::ios_base::binary);
+template <typename T>
+uint32_t get_batch_size(T &file) {
+	char data[BatchHeader::MAX_SIZE];
+	file.seekg(0, std::ios_base::beg);
+	file.read(data, sizeof(data));
+	auto n = file.gcount();
+	file.clear();
 
-	uint32_t n = get_batch_size(file);
+	BatchHeader header;
+	return header.parse(data, n)? header.count: 0;
+}
 
-	std::cerr << file_name << " contains " << n << " particles\n";
+// false als version geen sensor van deze grootte kan bewaren
+bool new_batch_file(const char *file_name, int version = BatchHeader::LATEST, int sensor_width = SingleChip::WIDTH, int sensor_height = SingleChip::HEIGHT);
 
-	std::vector<Tuple> result;
-	result.reserve(n);
-	for (uint32_t i = 0; i < n; ++i) {
-		result.push_back(Tuple());
-		std::get<0>(result.back()) = Particle::read_from_file(file);
-		if (!f(result.back())) result.pop_back();
-	}
+void save_batch(const char *file_name, const std::vector<Particle> &particles);
 
-	return result;
-}
\ No newline at end of file
+// false als een bestand niet te lezen of te schrijven is of niet van de sensor van destination
+bool append_batch(const char *destination, const std::vector<const char *> &sources);
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <optional>
+
+/*
+	Queue met een maximale grootte tussen threads. push wacht als de queue vol is,
+	pop wacht tot er iets is of tot de queue gesloten is en leeg.
+*/
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	void push(T value) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [this] { return items.size() < capacity; });
+		items.push_back(std::move(value));
+		not_empty.notify_one();
+	}
+
+	bool pop(T &value) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [this] { return !items.empty() || closed; });
+		if (items.empty()) return false;
+		value = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		not_empty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable not_full, not_empty;
+};
+
+/*
+	Zet resultaten die in willekeurige volgorde klaar zijn weer op volgorde van index,
+	beginnend bij 0. Er kunnen hoogstens capacity indexen tegelijk onderweg zijn:
+	reserve(index) wacht tot index - (volgende index die take geeft) < capacity.
+*/
+template <typename T>
+class OrderedBuffer {
+public:
+	explicit OrderedBuffer(size_t capacity) : capacity(capacity) {}
+
+	void reserve(long index) {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&] { return index - next < (long)capacity; });
+	}
+
+	void put(long index, T value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.emplace(index, std::move(value));
+		changed.notify_all();
+	}
+
+	// het resultaat met de volgende index, of niets als close() is aangeroepen en die nooit komt
+	std::optional<T> take() {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this] { return ready.count(next) || (closed && next >= end); });
+		auto it = ready.find(next);
+		if (it == ready.end()) return std::nullopt;
+		auto value = std::move(it->second);
+		ready.erase(it);
+		++next;
+		changed.notify_all();
+		return value;
+	}
+
+	// na close(end) komen er geen resultaten met index >= end meer
+	void close(long end_index) {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		end = end_index;
+		changed.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::map<long, T> ready;
+	long next = 0;
+	long end = 0;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable changed;
+};
@@ -1,329 +1,393 @@
 /*
 
 	Compileer met: 
-	g++ -Wall -O2 -std=c++17 -o query query.cpp particle.cpp
+	g++ -Wall -O2 -std=c++17 -pthread -o query query.cpp particle.cpp
+
+	Gebruik:
+	query [gecomprimeerd...] (offset hoek) {opties...}
+
+	[gecomprimeerd] mag meerdere bestanden en mappen zijn; van een map worden alle bestanden
+	gebruikt (behalve indexen en die met een punt voor de naam), op naam gesorteerd. De bestanden worden
+	tegelijk gedaan, verdeeld over --threads, en de uitvoer is dezelfde als van de query op
+	de bestanden achter elkaar geplakt (met compressor append).
+
+	Opties:
+	--threads=N		filter met N threads (0 = alle cores, standaard 1)
+	--fit=M			lijn fit: gradient (standaard), closed of hybrid
+				closed is de exacte gesloten vorm, maar geeft op veel sporen een andere lijn
+				(soms 90 graden gedraaid) dan gradient en verandert dus welke deeltjes door de
+				cost grens komen en de uitkomst van de query; hybrid geeft dezelfde lijnen als
+				gradient en is ongeveer 2 keer zo snel, zie --check-fit
+	--check-fit		vergelijk de gekozen --fit met gradient in plaats van de query te doen
+	--stream		tel elk deeltje meteen mee in plaats van alle deeltjes te bewaren,
+				het geheugengebruik blijft dan gelijk bij grote bestanden
+	--top=K			bewaar de K deeltjes met de hoogste cost (standaard 1) en print ze als K > 1
+	--incremental		ga verder waar de vorige query met dezelfde voorwaarden en opties gebleven
+				is, en doe alleen de deeltjes die er sindsdien bij gekomen zijn; de stand
+				staat per bestand in [gecomprimeerd].qcp
+	--from=T		alleen deeltjes vanaf tijd T, als seconden sinds 1970 of als lokale tijd
+				"2023-02-02 14:30:00"; met de index ([gecomprimeerd].idx, zie compressor
+				index) wordt het begin opgezocht in plaats van het hele bestand te lezen
+	--to=T			alleen deeltjes van voor tijd T
+	--rate=S		print per tijdvak van S seconden hoeveel deeltjes er waren en hoeveel
+				door de query kwamen, en dat per seconde
+	--follow(=MS)		volg [gecomprimeerd] terwijl compressor auto of watch erin schrijft, zoals
+				tail -f: lees elke MS ms (standaard 1000) alleen de nieuwe deeltjes en vervang
+				histogrammen.txt, plaatje.txt en laatste_meting.txt, tot je het stopt (Ctrl-C)
+	--canvas=M		welke canvassen er gemaakt worden, met komma's: max (plaatje.txt, de
+				standaard), sum (plaatje_som.txt) en count (plaatje_aantal.txt, het aantal
+				deeltjes per pixel); ze worden in de filter threads gevuld
+	--binary-canvas		schrijf de canvassen en laatste_meting binair, als .cnv in plaats van .txt
+				(zie canvas.h), dat is kleiner en sneller te lezen
+	--cuts=BESTAND		lees de voorwaarden uit BESTAND in plaats van de standaard voorwaarden
+	--cut=VOORWAARDE	voeg een voorwaarde toe, bijvoorbeeld --cut="abs(v_angle) < 20"
+	--features		print de features die een voorwaarde kan gebruiken
+	--simd=S		SIMD kernels voor de lijn fit: auto (standaard: avx2 als de CPU dat kan),
+				scalar, avx2 of avx512; de uitkomst is bij alle keuzes gelijk
+
+	De standaard voorwaarden staan in DEFAULT_CUTS in query.h. In een bestand staat een
+	voorwaarde per regel en is alles na een # commentaar. Na de query staat op de
+	standaard error hoeveel deeltjes elke voorwaarde tegenkwamen en doorlieten.
+
+	De grootte van de sensor (en van plaatje.txt) komt uit de header van [gecomprimeerd];
+	alle bestanden moeten dezelfde sensor hebben.
+
+	Met -DQUERY_REAL_FLOAT rekent de lijn fit in float, zie line_kernels.h.
 
 */
 
-#include "particle.h"
+#include "query.h"
 
-#include <cmath>
-#include <numeric>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <ctime>
 
-using RealType = double;
+#include <dirent.h>
+#include <sys/stat.h>
 
-template <typename T>
-constexpr T sign(T x) {
-	if (x > 0) return 1;
-	if (x < 0) return -1;
-	return 0;
-}
-
-struct Vec2 {
-	RealType x{}, y{};
-
-	Vec2(RealType x, RealType y) : x(x), y(y) {}
-	Vec2() = default;
-
-	RealType dist2() const {
-		return x * x + y * y;
-	}
-
-	RealType dist() const {
-		return std::sqrt(dist2());
-	}
-
-	Vec2 operator+(const Vec2 &o) const {
-		return {x + o.x, y + o.y};
-	}
-
-	Vec2 operator-(const Vec2 &o) const {
-		return {x - o.x, y - o.y};
-	}
-};
-
-struct Line {
-	RealType a{}, b{}, c{};
-
-	Line(RealType a, RealType b, RealType c=1): a(a), b(b), c(c) {}
-	Line() = default;
-	Line(Vec2 p1, Vec2 p2): Line(
-			p2.y - p1.y,
-			p1.x - p2.x,
-			p1.x * p2.y - p2.x * p1.y
-		) {}
-
-	RealType dist2() const {
-		return a * a + b * b;
-	}
-
-	RealType dist() const {
-		return std::sqrt(dist2());
-	}
+/*
+	Vergelijkt fit_line met mode tegen get_line_from_pixels voor elk deeltje dat niet
+	tegen de rand ligt en minstens 5 pixels heeft. Geeft 0 terug als alles binnen de
+	toleranties valt.
+*/
+template <typename S>
+int check_fit(const char *file_name, FitMode mode, unsigned threads) {
+	constexpr RealType ANGLE_TOLERANCE = 1e-4, SCORE_TOLERANCE = 1e-5, LENGTH_TOLERANCE = 1e-5;
 
-	void norm() {
-		operator/=(dist());
-	}
+	// angle, score en length verschil, en of cost < .05 anders uitvalt
+	auto batch = read_batch_filtered<std::tuple<SparseParticle, RealType, RealType, RealType, bool>>(file_name, [](const ParticleView &p) {
+		return !p.template touches_border<S>() && p.pixel_count >= 5;
+	}, [=](auto &x) {
+		auto &[p, d_angle, d_score, d_length, flipped] = x;
 
-	RealType angle() const {
-		return std::atan(-a / b) / 3.141592 * 180;
-	}
+		auto pixels = pixels_from_particle(p);
+		if (pixels.size() < 5) return false;
 
-	Vec2 parametic_t0() const {
-		auto d = dist2();
-		return {c * (a + b) / d, c * (b - a) / d};
-	}
+		auto [reference, reference_cost] = get_line_from_pixels(pixels);
+		auto [line, cost] = fit_line(pixels, mode);
+		reference.norm();
+		line.norm();
 
-	Vec2 parametic_offset(RealType t) const {
-		return {-b * t, a * t};
+		d_angle = std::abs(line.angle() - reference.angle());
+		d_angle = std::min(d_angle, 180 - d_angle);
+		d_score = std::abs(cost - reference_cost) / std::max(reference_cost, RealType(1e-12));
+		d_length = std::abs(length_segment(line, pixels) - length_segment(reference, pixels));
+		flipped = (cost < .05) != (reference_cost < .05);
+		return true;
+	}, threads);
+
+	RealType max_angle = 0, max_score = 0, max_length = 0;
+	int outside = 0, flips = 0;
+	for (const auto &[p, d_angle, d_score, d_length, flipped] : batch) {
+		max_angle = std::max(max_angle, d_angle);
+		max_score = std::max(max_score, d_score);
+		max_length = std::max(max_length, d_length);
+		outside += d_angle > ANGLE_TOLERANCE || d_score > SCORE_TOLERANCE || d_length > LENGTH_TOLERANCE;
+		flips += flipped;
 	}
 
-	Vec2 parametic(RealType t) const {
-		return parametic_offset(t) + parametic_t0();
-	}
+	std::cout << "checked fits: " << batch.size() << '\n';
+	std::cout << "max angle difference: " << max_angle << '\n';
+	std::cout << "max relative score difference: " << max_score << '\n';
+	std::cout << "max length difference: " << max_length << '\n';
+	std::cout << "outside tolerance: " << outside << '\n';
+	std::cout << "cost < .05 flipped: " << flips << '\n';
 
-	RealType projection(const Vec2 &p) const {
-		return (p.y * a - p.x * b + c) / dist2();
-	}
+	return outside || flips;
+}
 
-	Line &operator+=(const Line &o) {
-		a += o.a;
-		b += o.b;
-		c += o.c;
-		return *this;
-	}
+// vervangt name in 1 keer door wat write(naam) schrijft, zodat wie meekijkt nooit een half bestand ziet
+template <typename Function>
+void replace_file(const char *name, Function write) {
+	auto temporary = std::string(name) + ".tmp";
+	write(temporary.data());
+	if (std::rename(temporary.data(), name)) std::cerr << strerror(errno) << ':' << name << '\n';
+}
 
-	Line &operator-=(const Line &o) {
-		a -= o.a;
-		b -= o.b;
-		c -= o.c;
-		return *this;
+/*
+	Volgt file_name terwijl de compressor erin schrijft, zoals tail -f, tot het programma
+	gestopt wordt. Elke interval_ms worden alleen de nieuwe deeltjes gelezen en worden
+	histogrammen.txt (wat de query anders op de standaard uitvoer zet), de canvassen (plaatje.txt
+	enzovoort) en laatste_meting.txt vervangen als er iets bij gekomen is.
+*/
+template <typename S>
+int follow_query(const char *file_name, QueryPlan &plan, const QueryOptions &options, int interval_ms) {
+	BatchFollower follower(file_name);
+	auto result = options.aggregate<S>();
+	bool wrote = false;
+	for (auto next = std::chrono::steady_clock::now();; std::this_thread::sleep_until(next)) {
+		next += std::chrono::milliseconds(interval_ms);
+
+		auto reader = follower.poll();
+		if (follower.restarted()) result = options.aggregate<S>();
+		auto &header = follower.batch_header();
+		if (reader && (header.sensor_width != S::WIDTH || header.sensor_height != S::HEIGHT)) {
+			std::cerr << file_name << " now has a sensor of " << header.sensor_width << " x " << header.sensor_height << " pixels\n";
+			return 1;
+		}
+		if (!reader && wrote) continue;
+
+		auto added = options.aggregate<S>();
+		if (reader) query_particles(*reader, plan, options, true, options.threads, added);
+		result.merge(added);
+
+		replace_file("histogrammen.txt", [&](const char *name) {
+			std::ofstream out(name);
+			out << "particles: " << header.count << '\n';
+			out << "filtered batch size: " << result.count << '\n';
+			result.print(options.offset_angle, out);
+		});
+		for (auto &name : result.canvases.write(options.binary_canvas, ".tmp")) {
+			if (std::rename((name + ".tmp").data(), name.data())) std::cerr << strerror(errno) << ':' << name << '\n';
+		}
+		auto last = Aggregate<S>::last_name(options.binary_canvas);
+		replace_file(last, [&](const char *name) { result.write_last(options.binary_canvas, name); });
+		wrote = true;
+		std::cerr << file_name << ": " << header.count << " particles, " << result.count << " through the query\n";
 	}
+}
 
-	Line &operator*=(RealType x) {
-		a *= x;
-		b *= x;
-		c *= x;
-		return *this;
+/*
+	De query op de batch bestanden in files, allemaal van sensor S. Meerdere bestanden worden
+	elk apart gedaan, met de threads verdeeld over de bestanden, en daarna op volgorde
+	samengevoegd. Dat geeft dezelfde uitvoer als de query op de bestanden achter elkaar.
+*/
+template <typename S>
+int run_query(const std::vector<std::string> &files, QueryPlan &plan, const QueryOptions &options) {
+	auto result = options.aggregate<S>();
+	if (files.size() == 1) {
+		result = query_file<S>(files[0].data(), plan, options, options.threads);
+	} else {
+		unsigned total = options.threads? options.threads: ThreadPool::default_thread_count();
+		unsigned workers = std::min<size_t>(total, files.size());
+		std::vector<Aggregate<S>> parts(files.size());
+		{
+			// de destructor wacht tot alle bestanden klaar zijn
+			ThreadPool pool(workers);
+			for (size_t i = 0; i < files.size(); ++i) {
+				pool.submit([&, i] {
+					parts[i] = query_file<S>(files[i].data(), plan, options, std::max(1u, total / workers));
+				});
+			}
+		}
+		for (auto &part : parts) result.merge(part);
 	}
 
-	Line &operator/=(RealType x) {
-		return this->operator*=(1 / x);
-	}
+	plan.report(std::cerr);
+	std::cout << "filtered batch size: " << result.count << '\n';
 
-	Line operator*(RealType x) const {
-		return {a*x, b*x, c*x};
-	}
+	result.print(options.offset_angle);
+	result.write_canvases(options.binary_canvas);
 
-	void print() const {
-		std::cout << a << "x + " << b << "y = " << c << '\n';
-	}
-};
-
-struct Pixel {
-	Vec2 pos{};
-	RealType w{};
-
-	Pixel(Vec2 p, RealType w) : pos(p), w(w) {}
-};
-
-std::vector<Pixel> pixels_from_particle(const Particle &p) {
-	std::vector<Pixel> result;
-	int n = 0;
-	for (auto x : p.data) n += x != 0;
-	auto avg = RealType(std::accumulate(p.data.begin(), p.data.end(), 0)) / RealType(n);
-	for (int i = 0; i < p.width * p.height; ++i) {
-		if (p.data[i]) result.emplace_back(Vec2{RealType(i % p.width), RealType(i / p.width)}, RealType(p.data[i]) / avg);
+	if (options.top_k > 1) {
+		std::cout << "\nhighest cost:\n";
+		for (const auto &[cost, index, p] : result.sorted_top()) {
+			std::cout << "cost: " << cost << '\n';
+			p.print();
+		}
 	}
-	return result;
-}
 
-RealType score(const Line &line, const std::vector<Pixel> &pixels) {
-	RealType C = 0;
-	for (auto &p : pixels) {
-		auto x = line.a * p.pos.x + line.b * p.pos.y - line.c;
-		C = std::max(x * x, C);
-	}
-	return C / RealType(pixels.size()) / line.dist2();
+	return 0;
 }
 
-Line score_gradient(const Line &l, const Pixel &p, RealType d2) {
-	RealType C = (-l.c + l.a * p.pos.x + l.b * p.pos.y);
-	return {
-		p.w * C * (-l.a * C + p.pos.x * d2),
-		p.w * C * (-l.b * C + p.pos.y * d2),
-		p.w * -C * d2,
-	};
+// bestanden die bij een batch bestand in dezelfde map horen: zijn index en checkpoint
+bool is_sidecar(const std::string &name) {
+	auto base = name.substr(0, name.rfind('.'));
+	return name == BatchIndex::file_name(base.data()) || name == Checkpoint::file_name(base.data());
 }
 
-std::pair<Line, RealType> get_line_from_pixels(const std::vector<Pixel> &pixels, int iterations=10000, RealType gamma=0.001) {
-	Line result(pixels.front().pos, pixels.back().pos);
-	result.norm();
-
-	RealType n = RealType(pixels.size());
-	for (int i = 0; i < iterations; ++i) {
-		Line gradient{};
-		auto d2 = result.dist2();
-
-		for (auto &p : pixels) {
-			gradient += score_gradient(result, p, d2);
+/*
+	Zet de bestanden van paths in files. Van een map worden alle bestanden gebruikt waarvan de
+	naam niet met een punt begint, op naam gesorteerd, behalve indexen en checkpoints. Geeft false en een
+	melding als een pad niet te lezen is.
+*/
+bool list_batch_files(const std::vector<const char *> &paths, std::vector<std::string> &files) {
+	for (auto path : paths) {
+		struct stat info;
+		if (stat(path, &info)) {
+			std::cerr << strerror(errno) << ':' << path << '\n';
+			return false;
+		}
+		if (!S_ISDIR(info.st_mode)) {
+			files.push_back(path);
+			continue;
 		}
 
-		result -= gradient * (2 * gamma / (n * d2 * d2));
-		result.norm();
+		auto dir = opendir(path);
+		if (!dir) {
+			std::cerr << strerror(errno) << ':' << path << '\n';
+			return false;
+		}
+		std::vector<std::string> names;
+		while (auto entry = readdir(dir)) {
+			if (entry->d_name[0] == '.') continue;
+			auto name = std::string(path) + '/' + entry->d_name;
+			if (is_sidecar(name)) continue;
+			if (!stat(name.data(), &info) && S_ISREG(info.st_mode)) names.push_back(name);
+		}
+		closedir(dir);
+		std::sort(names.begin(), names.end());
+		files.insert(files.end(), names.begin(), names.end());
 	}
-
-	return {result, score(result, pixels)};
+	if (files.empty()) std::cerr << "No batch files found.\n";
+	return !files.empty();
 }
 
-int max_delta(const Particle &p) {
-	std::vector<RealType> sorted;
-	sorted.reserve(p.data.size());
-	for (auto i = 0; i < p.area(); ++i) sorted.push_back(p.data[i]);
-	std::sort(sorted.begin(), sorted.end());
-	std::vector<int> delta(sorted.size());
-	std::adjacent_difference(sorted.begin(), sorted.end(), delta.begin());
-	return *std::max_element(delta.begin() + (delta.end() - delta.begin()) / 2, delta.end());
-}
-
-RealType avg_energy(const Particle &p) {
-	int pixels = 0, total = 0;
-	for (auto i = 0; i < p.area(); ++i) {
-		if (p.data[i]) ++pixels;
-		total += p.data[i];
+/*
+	Een tijd als seconden sinds 1970 (UTC), of als lokale tijd "2023-02-02 14:30(:00)"
+	(ook met een T in plaats van de spatie) of "2023-02-02". false als text geen tijd is.
+*/
+bool parse_time(const char *text, int64_t &ticks) {
+	using sys_clock = SparseParticle::sys_clock;
+	char *end = nullptr;
+	double seconds = std::strtod(text, &end);
+	if (*text && *end == 0) {
+		ticks = std::chrono::duration_cast<sys_clock::duration>(std::chrono::duration<double>(seconds)).count();
+		return true;
 	}
 
-	return RealType(total) / RealType(pixels);
+	for (auto format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"}) {
+		std::tm tm{};
+		auto rest = strptime(text, format, &tm);
+		if (!rest || *rest) continue;
+		tm.tm_isdst = -1;
+		ticks = sys_clock::from_time_t(std::mktime(&tm)).time_since_epoch().count();
+		return true;
+	}
+	std::cerr << "Cannot parse time '" << text << "'\n";
+	return false;
 }
 
-RealType length_segment(const Line &line, const std::vector<Pixel> &p) {
-	std::vector<RealType> t(p.size());
-	int n = p.size();
-	for (int i = 0; i < n; ++i) {
-		t[i] = line.projection(p[i].pos);
+int main(int argc, char const *argv[]) {
+	std::vector<const char *> args;
+	QueryOptions options;
+	bool check_fit = false;
+	bool incremental = false;
+	int follow_ms = 0;
+	QueryPlan plan(FEATURES);
+	for (auto cut : DEFAULT_CUTS) plan.add(cut);
+	for (int i = 1; i < argc; ++i) {
+		if (!strncmp(argv[i], "--threads=", 10)) options.threads = std::stoi(argv[i] + 10);
+		else if (!strcmp(argv[i], "--fit=gradient")) options.fit_mode = FitMode::gradient;
+		else if (!strcmp(argv[i], "--fit=closed")) options.fit_mode = FitMode::closed;
+		else if (!strcmp(argv[i], "--fit=hybrid")) options.fit_mode = FitMode::hybrid;
+		else if (!strcmp(argv[i], "--check-fit")) check_fit = true;
+		else if (!strcmp(argv[i], "--stream")) options.stream = true;
+		else if (!strcmp(argv[i], "--incremental")) incremental = true;
+		else if (!strcmp(argv[i], "--follow")) follow_ms = 1000;
+		else if (!strncmp(argv[i], "--follow=", 9)) follow_ms = std::max(1, std::stoi(argv[i] + 9));
+		else if (!strncmp(argv[i], "--top=", 6)) options.top_k = std::stoul(argv[i] + 6);
+		else if (!strncmp(argv[i], "--from=", 7)) {
+			if (!parse_time(argv[i] + 7, options.from)) return 1;
+		} else if (!strncmp(argv[i], "--to=", 5)) {
+			if (!parse_time(argv[i] + 5, options.to)) return 1;
+		} else if (!strncmp(argv[i], "--rate=", 7)) {
+			auto width = std::chrono::duration<double>(std::stod(argv[i] + 7));
+			options.rate_width = std::chrono::duration_cast<SparseParticle::sys_clock::duration>(width).count();
+			if (options.rate_width <= 0) {
+				std::cerr << "--rate needs a positive number of seconds\n";
+				return 1;
+			}
+		} else if (!strncmp(argv[i], "--canvas=", 9)) {
+			options.canvas_modes = parse_canvas_modes(argv[i] + 9);
+			if (!options.canvas_modes) return 1;
+		} else if (!strcmp(argv[i], "--binary-canvas")) options.binary_canvas = true;
+		else if (!strncmp(argv[i], "--simd=", 7)) {
+			if (!set_simd_level(argv[i] + 7)) return 1;
+		} else if (!strncmp(argv[i], "--cuts=", 7)) {
+			plan.clear();
+			if (!plan.load(argv[i] + 7)) return 1;
+		} else if (!strncmp(argv[i], "--cut=", 6)) {
+			if (!plan.add(argv[i] + 6)) return 1;
+		} else if (!strcmp(argv[i], "--features")) {
+			for (auto &f : FEATURES) std::cout << f.name << " (stage " << f.stage << "): " << f.description << '\n';
+			return 0;
+		} else if (!strncmp(argv[i], "--", 2)) {
+			std::cerr << "Unknown option '" << argv[i] << "'\n";
+			return 1;
+		} else args.push_back(argv[i]);
 	}
-	std::vector<int> sorted(p.size());
-	std::iota(sorted.begin(), sorted.end(), 0);
-	std::stable_sort(sorted.begin(), sorted.end(), [&t] (auto a, auto b) {
-		return t[a] < t[b];
-	});
-	return (line.parametic_offset((t[sorted[0]] * 10  * p[sorted[0]].w   + t[sorted[1]]   * p[sorted[1]].w)   / (10 * p[sorted[0]].w   + p[sorted[1]].w))
-		  - line.parametic_offset((t[sorted[n-1]] * 10 * p[sorted[n-1]].w + t[sorted[n-2]] * p[sorted[n-2]].w) / (10 * p[sorted[n-1]].w + p[sorted[n-2]].w))).dist();
-}
 
-RealType vertical_angle(RealType length) {
-	return std::atan(5.48571428571 / length) * 180 / 3.141592;
-}
+	// het laatste argument is de offset hoek als het een getal is en geen bestand
+	if (args.size() >= 2) {
+		struct stat info;
+		char *end = nullptr;
+		double angle = std::strtod(args.back(), &end);
+		if (*end == 0 && stat(args.back(), &info)) {
+			options.offset_angle = angle;
+			args.pop_back();
+		}
+	}
 
-int main(int argc, char const *argv[]) {
-	if (!(argc == 2 || argc == 3)) {
+	if (args.empty()) {
 		std::cerr << "No arguments given.\n";
 		return 0;
 	}
 
-	double offset_angle = 0;
-	if (argc == 3) offset_angle = std::stod(argv[2]);
-
-/*
-
-	Hieronder staat de query die wordt uitgevoerd op elk deeltje.
-
-	Hier staan alle drempelwaardes in verstopt. Dus verander hier waar nodig.
-
-*/
-
-	auto batch = read_batch_filtered<std::tuple<Particle, Line, RealType, int, RealType, RealType, RealType>>(argv[1], [=](auto &x) {
-		auto &[p, line, cost, md, length, h_angle, v_angle] = x;
-		if (p.touches_border() || avg_energy(p) >= 80 || *std::max_element(p.data.begin(), p.data.end()) >= 275) return false;
-
-		auto pixels = pixels_from_particle(p);
-		if (pixels.size() < 5) return false;
-
-		md = max_delta(p);
-		if (md >= 40) return false;
-
-		std::tie(line, cost) = get_line_from_pixels(pixels);
-		line.norm();
-		length = length_segment(line, pixels);
-		h_angle = line.angle() + offset_angle;
-		if (h_angle <= -90) h_angle += 180;
-		else if (h_angle >= 90) h_angle -= 180;
-		v_angle = vertical_angle(length);
-
-/*
-
-	Doe de '//' hieronder weg als je op horizontale of verticale invalshoek wil filteren.
-
-*/
-		return cost < .05
-			//&& std::abs(v_angle) < 20
-			//&& std::abs(std::abs(h_angle) - 90) < 30
-		;
-	});
-
-
-	std::stable_sort(batch.begin(), batch.end(), [](const auto &a, const auto &b) {
-		return std::get<2>(a) < std::get<2>(b);
-	});
-
-	std::cout << "filtered batch size: " << batch.size() << '\n';
-
-/*
-
-	Hieronder staan H_N en V_N. 
-
-	- H_N is het aantal partjes van de horizontale meting van -90 tot 90 graden.
-	- V_N is van verticale meting van 0 tot 90 graden.
-
-*/
-
-	constexpr int H_N = 15, V_N = 20;
-
-	RealType h_angle_sum = 0, v_angle_sum = 0;
-
-	int h_count[H_N]{};
-	int v_count[V_N]{};
-	for (const auto &[p, line, cost, md, length, h_angle, v_angle] : batch) {
-		h_angle_sum += h_angle;
-		v_angle_sum += v_angle;
-		h_count[std::min(int(((h_angle + 90) / 180) * RealType(H_N)), H_N-1)]++;
-		v_count[std::min(int((v_angle / 90) * RealType(V_N)), V_N-1)]++;
+	std::vector<std::string> files;
+	if (!list_batch_files(args, files)) return 1;
+	if (follow_ms && (files.size() > 1 || check_fit || incremental)) {
+		std::cerr << "--follow takes 1 file and no --check-fit or --incremental\n";
+		return 1;
 	}
 
-	std::cout << '\n';
-
-	std::cout << "h_angle:\n";
-	for (int i = 0; i < H_N; ++i) std::cout << RealType(i * 180 / H_N - 90) + 90. / RealType(H_N) << "," << RealType(h_count[i]) << '\n';
-	std::cout << '\n';
-
-	std::cout << "v_angle:\n";
-	for (int i = 0; i < V_N; ++i) {
-		auto angle = RealType(i * 90 / V_N) + 45. / RealType(V_N);
-		std::cout << angle << ", " << v_count[i] << '\n';
+	BatchHeader header;
+	if (!header.load(files[0].data())) return 1;
+	for (auto &file : files) {
+		BatchHeader other;
+		if (!other.load(file.data())) return 1;
+		if (!other.same_sensor(header)) {
+			std::cerr << file << " has a sensor of " << other.sensor_width << " x " << other.sensor_height << " pixels instead of "
+				<< header.sensor_width << " x " << header.sensor_height << '\n';
+			return 1;
+		}
 	}
-	std::cout << "\n";
 
-	std::cout << "v_angle / sin(theta):\n";
-	for (int i = 0; i < V_N; ++i) {
-		auto angle = RealType(i * 90 / V_N) + 45. / RealType(V_N);
-		std::cout << angle << ", " << RealType(v_count[i]) / std::sin(angle * 3.141592 / 180) << '\n';
+	// alles waar de uitkomst van afhangt; een checkpoint met een andere key wordt niet gebruikt
+	if (incremental) {
+		std::ostringstream key;
+		key << "fit=" << int(options.fit_mode) << " offset=" << std::hexfloat << options.offset_angle << " top=" << options.top_k
+			<< " stream=" << options.stream << " real=" << sizeof(RealType) << std::dec
+			<< " from=" << options.from << " to=" << options.to << " rate=" << options.rate_width
+			<< " canvas=" << options.canvas_modes << '\n';
+		for (auto &c : plan.conditions()) key << c << '\n';
+		options.checkpoint_key = key.str();
 	}
-	std::cout << "\n";
-
-	std::cout << "avg horizontal angle: " << h_angle_sum / RealType(batch.size()) << '\n';
-	std::cout << "avg vertical angle: " << v_angle_sum / RealType(batch.size()) << '\n';
-	std::cout << "offset angle: " << offset_angle << '\n';
 
-	write_canvas_to_file(convert_to_canvas(batch, [](const auto &p) {
-		return &std::get<0>(p);
-		auto angle = std::abs(std::get<5>(p));
-		if (angle <= 10 || angle >= 80) return &std::get<0>(p);
-		return (const Particle *)nullptr;
-	}), "plaatje.txt");
-
-	CANVAS last_p{};
-	std::get<0>(batch.back()).imprint_on_canvas(last_p);
-	write_canvas_to_file(last_p, "laatste_meting.txt");
-
-	return 0;
+	int rc = 1;
+	dispatch_sensor(header.sensor_width, header.sensor_height, [&](auto sensor) {
+		using S = decltype(sensor);
+		if (follow_ms) {
+			rc = follow_query<S>(files[0].data(), plan, options, follow_ms);
+			return;
+		}
+		if (!check_fit) {
+			rc = run_query<S>(files, plan, options);
+			return;
+		}
+		rc = 0;
+		for (auto &file : files) rc |= ::check_fit<S>(file.data(), options.fit_mode, options.threads);
+	});
+	return rc;
 }
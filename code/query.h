@@ -0,0 +1,606 @@
+#pragma once
+
+#include "batch_reader.h"
+#include "query_plan.h"
+#include "line_fit.h"
+#include "canvas.h"
+
+#include <cmath>
+#include <numeric>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <limits>
+
+/*
+	De query zelf, zonder de uitvoer: de features en standaard voorwaarden, wat er van de
+	deeltjes die erdoor komen bijgehouden wordt (Aggregate) en query_file. query.cpp maakt
+	er het programma van, bench meet er de query mee.
+*/
+
+/*
+
+	Hieronder staan de features waar de query op kan filteren, en de standaard voorwaarden.
+
+	Stage 0 kan zonder het deeltje uit te pakken, stage 1 heeft het uitgepakte deeltje nodig.
+	cost is ongeveer de tijd in ns; de lijn fit wordt maar 1 keer gedaan voor alle features die hem nodig hebben.
+	Deeltjes met minder dan 5 pixels hebben geen lijn en komen er nooit door.
+
+*/
+
+enum Feature { TOUCHES_BORDER, PIXELS, AVG_ENERGY, MAX_VALUE, MAX_DELTA, COST, LENGTH, H_ANGLE, V_ANGLE, H_ANGLE_FROM_90 };
+
+const std::vector<FeatureInfo> FEATURES = {
+	{"touches_border", 0, 1, "1 als het deeltje de rand van de sensor raakt"},
+	{"pixels", 0, 1, "aantal pixels die niet 0 zijn"},
+	{"avg_energy", 0, 2, "gemiddelde waarde van de pixels die niet 0 zijn"},
+	{"max", 0, 2, "hoogste waarde"},
+	{"max_delta", 1, 200, "grootste sprong tussen de gesorteerde waardes, in de bovenste helft"},
+	{"cost", 1, 10000, "hoe slecht de lijn past"},
+	{"length", 1, 10000, "lengte van het spoor"},
+	{"h_angle", 1, 10000, "horizontale hoek plus de offset hoek, van -90 tot 90"},
+	{"v_angle", 1, 10000, "verticale hoek"},
+	{"h_angle_from_90", 1, 10000, "abs(abs(h_angle) - 90)"},
+};
+
+const char *const DEFAULT_CUTS[] = {
+	"!touches_border",
+	"pixels >= 5",
+	"avg_energy < 80",
+	"max < 275",
+	"max_delta < 40",
+	"cost < .05",
+	//"abs(v_angle) < 20",
+	//"h_angle_from_90 < 30",
+};
+
+template <typename S>
+RealType view_feature(const ParticleView &p, int feature) {
+	switch (feature) {
+	case TOUCHES_BORDER: return p.touches_border<S>();
+	case PIXELS: return p.pixel_count;
+	case AVG_ENERGY: return avg_energy(p);
+	case MAX_VALUE: return p.max_value();
+	}
+	return 0;
+}
+
+/*
+	De features van een uitgepakt deeltje, uitgerekend als ze voor het eerst nodig zijn.
+*/
+struct Features {
+	std::vector<Pixel> pixels;
+	int md = 0;
+	Line line;
+	RealType cost = 0, length = 0, h_angle = 0, v_angle = 0;
+	bool has_pixels = false, has_md = false, has_fit = false;
+
+	// false als er geen lijn door de pixels te fitten is
+	bool fit(const SparseParticle &p, FitMode mode, RealType offset_angle) {
+		if (has_fit) return true;
+		if (!has_pixels) {
+			pixels = pixels_from_particle(p);
+			has_pixels = true;
+		}
+		if (pixels.size() < 5) return false;
+
+		std::tie(line, cost) = fit_line(pixels, mode);
+		line.norm();
+		length = length_segment(line, pixels);
+		h_angle = line.angle() + offset_angle;
+		if (h_angle <= -90) h_angle += 180;
+		else if (h_angle >= 90) h_angle -= 180;
+		v_angle = vertical_angle(length);
+		has_fit = true;
+		return true;
+	}
+
+	// alleen voor features van stage 1
+	RealType get(const SparseParticle &p, int feature, FitMode mode, RealType offset_angle) {
+		switch (feature) {
+		case MAX_DELTA:
+			if (!has_md) md = max_delta(p);
+			has_md = true;
+			return md;
+		}
+
+		if (!fit(p, mode, offset_angle)) return NAN;
+		switch (feature) {
+		case COST: return cost;
+		case LENGTH: return length;
+		case H_ANGLE: return h_angle;
+		case V_ANGLE: return v_angle;
+		case H_ANGLE_FROM_90: return std::abs(std::abs(h_angle) - 90);
+		}
+		return 0;
+	}
+};
+
+/*
+
+	Hieronder staan H_N en V_N. 
+
+	- H_N is het aantal partjes van de horizontale meting van -90 tot 90 graden.
+	- V_N is van verticale meting van 0 tot 90 graden.
+
+*/
+
+constexpr int H_N = 15, V_N = 20;
+
+// voor checkpoints: x precies zoals het in het geheugen staat
+template <typename T>
+void write_raw(std::ostream &out, const T &x) {
+	out.write(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+template <typename T>
+bool read_raw(std::istream &in, T &x) {
+	return bool(in.read(reinterpret_cast<char*>(&x), sizeof(x)));
+}
+
+inline void save_particle(std::ostream &out, const SparseParticle &p) {
+	write_raw(out, int64_t(p.time_point.time_since_epoch().count()));
+	for (int x : {p.start_x, p.start_y, p.width, p.height}) write_raw(out, int32_t(x));
+	write_raw(out, uint32_t(p.hits.size()));
+	out.write(reinterpret_cast<const char*>(p.hits.data()), p.hits.size() * sizeof(SparseParticle::Hit));
+}
+
+inline bool load_particle(std::istream &in, SparseParticle &p) {
+	int64_t t;
+	int32_t box[4];
+	uint32_t n;
+	if (!read_raw(in, t) || !read_raw(in, box) || !read_raw(in, n) || n > uint32_t(box[2]) * uint32_t(box[3])) return false;
+	p.time_point = SparseParticle::sys_clock::time_point{SparseParticle::sys_clock::duration{t}};
+	std::tie(p.start_x, p.start_y, p.width, p.height) = std::tie(box[0], box[1], box[2], box[3]);
+	p.hits.resize(n);
+	return bool(in.read(reinterpret_cast<char*>(p.hits.data()), n * sizeof(SparseParticle::Hit)));
+}
+
+/*
+	Som volgens Neumaier: houdt bij wat er bij het optellen wegvalt. Daardoor hangt de
+	uitkomst (bijna) niet af van de volgorde, ook niet als er deelsommen opgeteld worden.
+*/
+struct CompensatedSum {
+	RealType sum = 0, compensation = 0;
+
+	void add(RealType x) {
+		RealType t = sum + x;
+		if (std::abs(sum) >= std::abs(x)) compensation += (sum - t) + x;
+		else compensation += (x - t) + sum;
+		sum = t;
+	}
+
+	void add(const CompensatedSum &other) {
+		add(other.sum);
+		compensation += other.compensation;
+	}
+
+	RealType value() const {
+		return sum + compensation;
+	}
+};
+
+/*
+	Per tijdvak van width het aantal deeltjes en het aantal dat door de query komt. De
+	vakken worden vanaf 1970 (UTC) geteld, zodat ze voor alle bestanden en runs gelijk
+	liggen. Alleen vakken waar iets in valt worden bewaard.
+*/
+struct RateHistogram {
+	using sys_clock = SparseParticle::sys_clock;
+
+	int64_t width = 0;	// in ticks van sys_clock, 0 als er niets bijgehouden wordt
+	// begin van het vak -> (deeltjes, door de query)
+	std::map<int64_t, std::pair<uint64_t, uint64_t>> buckets;
+
+	// telt particles deeltjes, waarvan passed door de query kwamen, in het vak van t
+	void add(sys_clock::time_point t, uint64_t particles, uint64_t passed) {
+		if (!width) return;
+		auto ticks = t.time_since_epoch().count();
+		auto &counts = buckets[ticks - ((ticks % width) + width) % width];
+		counts.first += particles;
+		counts.second += passed;
+	}
+
+	void merge(const RateHistogram &other) {
+		for (auto &[begin, counts] : other.buckets) {
+			buckets[begin].first += counts.first;
+			buckets[begin].second += counts.second;
+		}
+	}
+
+	// het eerste en laatste vak zijn meestal niet helemaal gevuld, dus daar is de rate te laag
+	void print(std::ostream &out) const {
+		if (!width) return;
+		double seconds = std::chrono::duration<double>(sys_clock::duration{width}).count();
+		out << "\nrate per " << seconds << " s:\nbegin, particles, passed, passed per s\n";
+		for (auto &[begin, counts] : buckets) {
+			auto t = sys_clock::to_time_t(sys_clock::time_point{sys_clock::duration{begin}});
+			char text[32];
+			std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+			out << text << ", " << counts.first << ", " << counts.second << ", " << double(counts.second) / seconds << '\n';
+		}
+	}
+
+	void save(std::ostream &out) const {
+		write_raw(out, uint64_t(buckets.size()));
+		for (auto &[begin, counts] : buckets) {
+			write_raw(out, begin);
+			write_raw(out, counts);
+		}
+	}
+
+	bool load(std::istream &in) {
+		uint64_t n;
+		if (!read_raw(in, n)) return false;
+		buckets.clear();
+		for (uint64_t i = 0; i < n; ++i) {
+			int64_t begin;
+			std::pair<uint64_t, uint64_t> counts;
+			if (!read_raw(in, begin) || !read_raw(in, counts)) return false;
+			buckets[begin] = counts;
+		}
+		return true;
+	}
+};
+
+/*
+	Alles wat de uitvoer van de query nodig heeft, zonder de deeltjes zelf te bewaren.
+	Van de deeltjes worden alleen de top_k met de hoogste cost bewaard. De canvassen worden
+	niet door add gevuld maar per thread in query_particles, en daarna hierin samengevoegd.
+	Aggregates van opeenvolgende stukken kunnen met merge samengevoegd worden.
+*/
+template <typename S>
+struct Aggregate {
+	uint64_t count = 0;
+	CompensatedSum h_angle_sum, v_angle_sum;
+	int h_count[H_N]{};
+	int v_count[V_N]{};
+	CanvasLayers<S> canvases;
+	RateHistogram rate;
+
+	size_t top_k;
+	// (cost, volgnummer, deeltje), als heap met de laagste cost voorop
+	using Entry = std::tuple<RealType, uint64_t, SparseParticle>;
+	std::vector<Entry> top;
+
+	explicit Aggregate(size_t top_k = 1, int64_t rate_width = 0, unsigned canvas_modes = CANVAS_MAX) : canvases(canvas_modes), top_k(top_k) {
+		rate.width = rate_width;
+	}
+
+	// bij gelijke cost is het latere deeltje hoger, net als na stable_sort
+	static bool lower(const Entry &a, const Entry &b) {
+		return std::tie(std::get<0>(a), std::get<1>(a)) < std::tie(std::get<0>(b), std::get<1>(b));
+	}
+
+	static bool higher(const Entry &a, const Entry &b) {
+		return lower(b, a);
+	}
+
+	void add(const SparseParticle &p, RealType cost, RealType h_angle, RealType v_angle) {
+		h_angle_sum.add(h_angle);
+		v_angle_sum.add(v_angle);
+		h_count[std::min(int(((h_angle + 90) / 180) * RealType(H_N)), H_N-1)]++;
+		v_count[std::min(int((v_angle / 90) * RealType(V_N)), V_N-1)]++;
+		rate.add(p.time_point, 0, 1);
+
+		offer(cost, count, p);
+		++count;
+	}
+
+	// voegt other toe alsof zijn deeltjes na die van dit aggregate gekomen waren
+	void merge(const Aggregate &other) {
+		h_angle_sum.add(other.h_angle_sum);
+		v_angle_sum.add(other.v_angle_sum);
+		for (int i = 0; i < H_N; ++i) h_count[i] += other.h_count[i];
+		for (int i = 0; i < V_N; ++i) v_count[i] += other.v_count[i];
+		canvases.merge(other.canvases);
+		rate.merge(other.rate);
+
+		for (const auto &[cost, index, p] : other.top) offer(cost, count + index, p);
+		count += other.count;
+	}
+
+	void offer(RealType cost, uint64_t index, const SparseParticle &p) {
+		if (top.size() < top_k) {
+			top.emplace_back(cost, index, p);
+			std::push_heap(top.begin(), top.end(), higher);
+		} else if (top_k && std::make_pair(cost, index) > std::make_pair(std::get<0>(top.front()), std::get<1>(top.front()))) {
+			std::pop_heap(top.begin(), top.end(), higher);
+			top.back() = {cost, index, p};
+			std::push_heap(top.begin(), top.end(), higher);
+		}
+	}
+
+	// de bewaarde deeltjes, de hoogste cost achteraan
+	std::vector<Entry> sorted_top() const {
+		auto result = top;
+		std::sort(result.begin(), result.end(), lower);
+		return result;
+	}
+
+	void print(RealType offset_angle, std::ostream &out = std::cout) const {
+		out << '\n';
+
+		out << "h_angle:\n";
+		for (int i = 0; i < H_N; ++i) out << RealType(i * 180 / H_N - 90) + 90. / RealType(H_N) << "," << RealType(h_count[i]) << '\n';
+		out << '\n';
+
+		out << "v_angle:\n";
+		for (int i = 0; i < V_N; ++i) {
+			auto angle = RealType(i * 90 / V_N) + 45. / RealType(V_N);
+			out << angle << ", " << v_count[i] << '\n';
+		}
+		out << "\n";
+
+		out << "v_angle / sin(theta):\n";
+		for (int i = 0; i < V_N; ++i) {
+			auto angle = RealType(i * 90 / V_N) + 45. / RealType(V_N);
+			out << angle << ", " << RealType(v_count[i]) / std::sin(angle * 3.141592 / 180) << '\n';
+		}
+		out << "\n";
+
+		out << "avg horizontal angle: " << h_angle_sum.value() / RealType(count) << '\n';
+		out << "avg vertical angle: " << v_angle_sum.value() / RealType(count) << '\n';
+		out << "offset angle: " << offset_angle << '\n';
+		rate.print(out);
+	}
+
+	void save(std::ostream &out) const {
+		write_raw(out, count);
+		write_raw(out, h_angle_sum);
+		write_raw(out, v_angle_sum);
+		write_raw(out, h_count);
+		write_raw(out, v_count);
+		canvases.save(out);
+		rate.save(out);
+		write_raw(out, uint64_t(top.size()));
+		for (const auto &[cost, index, p] : top) {
+			write_raw(out, cost);
+			write_raw(out, index);
+			save_particle(out, p);
+		}
+	}
+
+	// false als in niet met een Aggregate van dezelfde top_k en canvas modes begint
+	bool load(std::istream &in) {
+		uint64_t n;
+		if (!read_raw(in, count) || !read_raw(in, h_angle_sum) || !read_raw(in, v_angle_sum) || !read_raw(in, h_count)
+			|| !read_raw(in, v_count) || !canvases.load(in) || !rate.load(in) || !read_raw(in, n) || n > top_k) return false;
+		top.resize(n);
+		for (auto &[cost, index, p] : top) {
+			if (!read_raw(in, cost) || !read_raw(in, index) || !load_particle(in, p)) return false;
+		}
+		return true;
+	}
+
+	// het deeltje met de hoogste cost
+	void write_last(bool binary, const char *file_name) const {
+		Canvas<S> last_p{};
+		if (!top.empty()) std::get<2>(sorted_top().back()).imprint_on_canvas(last_p);
+		CanvasLayers<S>::write_values(last_p, binary, file_name);
+	}
+
+	static const char *last_name(bool binary) {
+		return binary? "laatste_meting.cnv": "laatste_meting.txt";
+	}
+
+	void write_canvases(bool binary) const {
+		canvases.write(binary);
+		write_last(binary, last_name(binary));
+	}
+};
+
+/*
+	Waar een query met --incremental op een batch bestand gebleven is, in [bestand].qcp:
+		"QCP1", uint32_t lengte, key, uint16_t version, uint32_t flags,
+		uint16_t sensor_width, uint16_t sensor_height, uint32_t count, uint64_t offset,
+		int64_t time, uint64_t check, Aggregate
+	key beschrijft alles waar de uitkomst van afhangt: de voorwaarden en de opties. count is
+	het aantal gelezen deeltjes, offset de byte waar het volgende begint en time de tijd van
+	het laatste (voor versie 2). check is een hash van de bytes voor offset, zodat een
+	bestand dat niet alleen gegroeid is maar vervangen niet stilletjes verder gelezen wordt.
+*/
+struct Checkpoint {
+	static constexpr char MAGIC[4] = {'Q', 'C', 'P', '1'};
+	static constexpr uint64_t CHECK_BYTES = 64;
+
+	BatchHeader header;
+	uint32_t count = 0;
+	uint64_t offset = 0;
+	int64_t time = 0;
+	uint64_t check = 0;
+
+	static std::string file_name(const char *batch_file) {
+		return std::string(batch_file) + ".qcp";
+	}
+
+	// FNV-1a van de hoogstens CHECK_BYTES bytes voor offset, na de header
+	static uint64_t hash(const char *batch_file, const BatchHeader &header, uint64_t offset) {
+		if (offset < header.size) return 0;
+		uint64_t begin = std::max<uint64_t>(header.size, offset - std::min(offset, CHECK_BYTES));
+		char bytes[CHECK_BYTES];
+		std::ifstream file(batch_file, std::ios_base::binary);
+		file.seekg(begin);
+		file.read(bytes, offset - begin);
+		if (!file) return 0;
+		uint64_t h = 14695981039346656037ull;
+		for (uint64_t i = 0; i < offset - begin; ++i) h = (h ^ uint8_t(bytes[i])) * 1099511628211ull;
+		return h;
+	}
+
+	/*
+		Leest het checkpoint van batch_file in aggregate als het bij key en bij het bestand
+		zoals het nu is hoort. Zonder checkpoint, of als het niet klopt, false.
+	*/
+	template <typename S>
+	bool load(const char *batch_file, const std::string &key, const BatchHeader &current, Aggregate<S> &aggregate) {
+		auto name = file_name(batch_file);
+		std::ifstream in(name, std::ios_base::binary);
+		if (!in) return false;
+
+		char magic[4]{};
+		uint32_t length = 0;
+		std::string saved_key;
+		in.read(magic, 4);
+		if (read_raw(in, length) && length <= (1 << 20)) {
+			saved_key.resize(length);
+			in.read(saved_key.data(), length);
+		}
+		bool ok = in && !std::memcmp(magic, MAGIC, 4) && saved_key == key
+			&& read_raw(in, header.version) && read_raw(in, header.flags) && read_raw(in, header.sensor_width) && read_raw(in, header.sensor_height)
+			&& read_raw(in, count) && read_raw(in, offset) && read_raw(in, time) && read_raw(in, check)
+			&& aggregate.load(in);
+		if (!ok) {
+			std::cerr << name << " is from another query, starting from the beginning\n";
+			return false;
+		}
+		if (header.version != current.version || header.flags != current.flags || !header.same_sensor(current)
+			|| count > current.count || hash(batch_file, current, offset) != check) {
+			std::cerr << batch_file << " changed since " << name << ", starting from the beginning\n";
+			return false;
+		}
+		return true;
+	}
+
+	// schrijft het checkpoint in 1 keer, net als IngestStats
+	template <typename S>
+	void save(const char *batch_file, const std::string &key, const Aggregate<S> &aggregate) const {
+		auto name = file_name(batch_file), temporary = name + ".tmp";
+		std::ofstream out(temporary, std::ios_base::binary);
+		out.write(MAGIC, 4);
+		write_raw(out, uint32_t(key.size()));
+		out.write(key.data(), key.size());
+		write_raw(out, header.version);
+		write_raw(out, header.flags);
+		write_raw(out, header.sensor_width);
+		write_raw(out, header.sensor_height);
+		write_raw(out, count);
+		write_raw(out, offset);
+		write_raw(out, time);
+		write_raw(out, check);
+		aggregate.save(out);
+		out.close();
+		if (!out || std::rename(temporary.data(), name.data())) std::cerr << strerror(errno) << ':' << name << '\n';
+	}
+};
+
+// alles behalve de voorwaarden wat bepaalt wat er uit een query komt
+struct QueryOptions {
+	FitMode fit_mode = FitMode::gradient;
+	RealType offset_angle = 0;
+	size_t top_k = 1;
+	bool stream = false;
+	unsigned threads = 1;
+	// alleen de deeltjes met een tijd in [from, to), in ticks van sys_clock
+	int64_t from = std::numeric_limits<int64_t>::min(), to = std::numeric_limits<int64_t>::max();
+	// breedte van de vakken van de rate, 0 zonder --rate
+	int64_t rate_width = 0;
+	// zie Checkpoint, leeg zonder --incremental
+	std::string checkpoint_key;
+	// welke canvassen er gemaakt worden (CanvasMode), en of ze binair geschreven worden
+	unsigned canvas_modes = CANVAS_MAX;
+	bool binary_canvas = false;
+
+	bool has_time_range() const {
+		return from != std::numeric_limits<int64_t>::min() || to != std::numeric_limits<int64_t>::max();
+	}
+
+	template <typename S>
+	Aggregate<S> aggregate() const {
+		return Aggregate<S>(top_k, rate_width, canvas_modes);
+	}
+};
+
+// de deeltjes van reader (vanaf waar hij staat) die door de query komen, toegevoegd aan result
+template <typename S>
+void query_particles(BatchReader &reader, QueryPlan &plan, const QueryOptions &options, bool stream, unsigned threads, Aggregate<S> &result) {
+	using Tuple = std::tuple<SparseParticle, Features>;
+
+	// pre wordt voor elk deeltje op volgorde aangeroepen, in 1 thread
+	auto pre = [&plan, &options, &result](const ParticleView &p) {
+		auto t = p.time_point.time_since_epoch().count();
+		if (t < options.from || t >= options.to) return false;
+		result.rate.add(p.time_point, 1, 0);
+		return plan.run(0, [&p](int feature) { return view_feature<S>(p, feature); });
+	};
+
+	// elke thread vult zijn eigen canvassen, die na afloop bij result opgeteld worden
+	PerThread<CanvasLayers<S>> canvases([modes = result.canvases.modes] { return CanvasLayers<S>(modes); });
+
+	auto query = [&plan, &canvases, fit_mode = options.fit_mode, offset_angle = options.offset_angle](auto &x) {
+		auto &[p, f] = x;
+		bool pass = plan.run(1, [&](int feature) { return f.get(p, feature, fit_mode, offset_angle); })
+			// de uitvoer heeft de hoeken nodig, ook als geen voorwaarde ze gebruikt
+			&& f.fit(p, fit_mode, offset_angle);
+		f.pixels = {};
+
+		// Doe de '//' hieronder weg als je alleen bijna horizontale of verticale sporen in plaatje.txt wil.
+		//if (std::abs(f.h_angle) <= 10 || std::abs(f.h_angle) >= 80)
+		if (pass) canvases.local().imprint(p);
+		return pass;
+	};
+
+	auto add = [&result](const Tuple &x) {
+		const auto &[p, f] = x;
+		result.add(p, f.cost, f.h_angle, f.v_angle);
+	};
+
+	if (stream) {
+		for_each_filtered<Tuple>(reader, pre, query, add, threads);
+	} else {
+		auto batch = read_batch_filtered<Tuple>(reader, pre, query, threads);
+
+		std::stable_sort(batch.begin(), batch.end(), [](const auto &a, const auto &b) {
+			return std::get<1>(a).cost < std::get<1>(b).cost;
+		});
+
+		for (const auto &x : batch) add(x);
+	}
+	canvases.for_each([&result](const CanvasLayers<S> &c) { result.canvases.merge(c); });
+}
+
+/*
+	De query op file_name, een batch bestand van sensor S. Met een checkpoint_key wordt
+	verder gegaan vanaf het checkpoint van het bestand, als dat er is en klopt, en wordt
+	daarna een nieuw checkpoint geschreven. Met een tijdsbereik worden alleen de deeltjes
+	daarin gelezen.
+*/
+template <typename S>
+Aggregate<S> query_file(const char *file_name, QueryPlan &plan, const QueryOptions &options, unsigned threads) {
+	auto &checkpoint_key = options.checkpoint_key;
+	BatchReader reader(file_name);
+	std::cerr << file_name << " contains " << reader.size() << " particles\n";
+
+	// met de index naar het begin en einde van de tijden; pre houdt de rest tegen
+	BatchRange range{0, reader.size(), reader.offset(), 0, 0};
+	if (options.has_time_range()) {
+		range = reader.time_range(options.from, options.to);
+		std::cerr << range.count << " of them in the time range\n";
+	}
+
+	auto result = options.aggregate<S>(), earlier = options.aggregate<S>();
+	Checkpoint checkpoint;
+	bool resume = !checkpoint_key.empty() && checkpoint.load(file_name, checkpoint_key, reader.header(), earlier);
+	if (resume && checkpoint.count > range.first) {
+		uint32_t end = std::max(range.first + range.count, checkpoint.count);
+		range = {checkpoint.count, end - checkpoint.count, checkpoint.offset, 0, checkpoint.time};
+		std::cerr << "continuing at particle " << checkpoint.count << " from " << Checkpoint::file_name(file_name) << '\n';
+	}
+	reader.restrict(range);
+
+	query_particles(reader, plan, options, options.stream, threads, result);
+
+	if (resume) {
+		earlier.merge(result);
+		result = std::move(earlier);
+	}
+	if (!checkpoint_key.empty()) {
+		checkpoint.header = reader.header();
+		checkpoint.count = reader.index();
+		checkpoint.offset = reader.offset();
+		checkpoint.time = reader.time();
+		checkpoint.check = Checkpoint::hash(file_name, checkpoint.header, checkpoint.offset);
+		checkpoint.save(file_name, checkpoint_key, result);
+	}
+	return result;
+}
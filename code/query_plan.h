@@ -0,0 +1,306 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+/*
+	Een feature die een voorwaarde kan gebruiken. stage zegt wat er van een deeltje
+	nodig is (de query bepaalt wat dat betekent), cost is een schatting van de tijd.
+*/
+struct FeatureInfo {
+	const char *name;
+	int stage;
+	double cost;
+	const char *description;
+};
+
+/*
+	Een query als lijst van voorwaarden zoals "max_delta < 40", "abs(v_angle) < 20",
+	"pixels >= 5" of "!touches_border". Een deeltje komt erdoor als alle voorwaarden gelden.
+
+	Per stage worden de voorwaarden getest van de goedkoopste feature naar de duurste, en bij
+	gelijke cost eerst degene die het vaakst afkeurt. Dat wordt tijdens het lopen gemeten, dus
+	de volgorde past zich aan. De gemeten tijd wordt niet voor de volgorde gebruikt, want een
+	voorwaarde betaalt soms voor een feature die een volgende voorwaarde daarna gratis krijgt.
+
+	run mag vanuit meerdere threads tegelijk; elke thread houdt zijn eigen volgorde en telt
+	eerst lokaal, en geeft dat af en toe door aan het plan.
+*/
+class QueryPlan {
+public:
+	enum class Op { less, less_equal, greater, greater_equal, equal, not_equal };
+
+	explicit QueryPlan(std::vector<FeatureInfo> features) : features(std::move(features)) {}
+
+	QueryPlan(const QueryPlan &) = delete;
+	QueryPlan &operator=(const QueryPlan &) = delete;
+
+	~QueryPlan() {
+		if (state.plan == this) state.reset();
+	}
+
+	// false en een melding als text geen voorwaarde is
+	bool add(const std::string &text) {
+		auto predicate = std::make_unique<Predicate>();
+		predicate->text = text;
+		if (!parse(text, *predicate)) {
+			std::cerr << "Cannot parse condition '" << text << "'\n";
+			return false;
+		}
+		predicates.push_back(std::move(predicate));
+		return true;
+	}
+
+	// een voorwaarde per regel, alles na een # is commentaar
+	bool load(const char *file_name) {
+		std::ifstream file(file_name);
+		if (!file) {
+			std::cerr << "Cannot open '" << file_name << "'\n";
+			return false;
+		}
+		for (std::string line; std::getline(file, line);) {
+			line = trim(line.substr(0, line.find('#')));
+			if (!line.empty() && !add(line)) return false;
+		}
+		return true;
+	}
+
+	void clear() {
+		predicates.clear();
+	}
+
+	// of het deeltje door alle voorwaarden van stage komt; value(feature) geeft de waarde van een feature
+	template <typename Function>
+	bool run(int stage, Function value) {
+		if (++state.runs % FLUSH_EVERY == 0) state.flush();
+		auto &order = state.order(*this, stage);
+		for (size_t k = 0; k < order.size(); ++k) {
+			auto i = order[k];
+			auto &p = *predicates[i];
+			auto &local = state.counts[i];
+
+			bool timed = local.evaluated++ % TIME_EVERY == 0;
+			auto start = timed? clock::now(): clock::time_point{};
+			bool ok = test(p, value(p.feature));
+			if (timed) {
+				local.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+				++local.timed;
+			}
+			local.passed += ok;
+			if (!ok) return false;
+		}
+		return true;
+	}
+
+	// zet wat deze thread nog lokaal geteld heeft in het plan
+	void flush() {
+		if (state.plan == this) state.flush();
+	}
+
+	/*
+		Per voorwaarde hoe vaak hij getest is, hoe vaak het deeltje erdoor kwam en hoeveel tijd
+		dat kostte. Omdat de volgorde verandert hoeft het aantal dat een voorwaarde test niet
+		gelijk te zijn aan het aantal dat door de voorwaarde ervoor kwam.
+	*/
+	void report(std::ostream &out) {
+		flush();
+		out << "query plan:\n";
+		for (int stage = 0; stage <= max_stage(); ++stage) {
+			for (auto i : sorted(stage)) {
+				auto &p = *predicates[i];
+				uint64_t evaluated = p.evaluated, passed = p.passed, timed = p.timed;
+				double ms = timed? 1e-6 * double(p.ns) * double(evaluated) / double(timed): 0;
+				out << "  " << stage << "  " << std::left << std::setw(28) << p.text << std::right
+					<< std::setw(10) << evaluated << " -> " << std::setw(10) << passed
+					<< "  (" << std::fixed << std::setprecision(1) << std::setw(5) << (evaluated? 100. * double(passed) / double(evaluated): 100.) << "%)  "
+					<< std::setprecision(2) << ms << " ms\n" << std::defaultfloat << std::setprecision(6);
+			}
+		}
+	}
+
+	// de voorwaarden zoals ze opgegeven zijn
+	std::vector<std::string> conditions() const {
+		std::vector<std::string> result;
+		for (auto &p : predicates) result.push_back(p->text);
+		return result;
+	}
+
+	const std::vector<FeatureInfo> &feature_list() const {
+		return features;
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	// de tijd van 1 op de TIME_EVERY tests wordt gemeten, omdat meten zelf meer kost dan een goedkope test
+	static constexpr uint64_t TIME_EVERY = 16;
+	static constexpr uint64_t FLUSH_EVERY = 1024;
+
+	struct Predicate {
+		std::string text;
+		int feature{};
+		Op op{};
+		double value{};
+		bool absolute = false;
+		std::atomic<uint64_t> evaluated{0}, passed{0}, timed{0}, ns{0};
+	};
+
+	struct Counts {
+		uint64_t evaluated = 0, passed = 0, timed = 0, ns = 0;
+	};
+
+	// wat een thread zelf bijhoudt, voor hoogstens 1 plan tegelijk
+	struct ThreadState {
+		QueryPlan *plan = nullptr;
+		std::vector<Counts> counts;
+		std::vector<std::vector<size_t>> orders;
+		uint64_t runs = 0;
+
+		~ThreadState() {
+			flush();
+		}
+
+		std::vector<size_t> &order(QueryPlan &p, int stage) {
+			if (plan != &p || counts.size() != p.predicates.size()) {
+				flush();
+				plan = &p;
+				counts.assign(p.predicates.size(), {});
+				orders.clear();
+			}
+			if (orders.empty()) {
+				for (int s = 0; s <= p.max_stage(); ++s) orders.push_back(p.sorted(s));
+			}
+			return orders[stage];
+		}
+
+		void flush() {
+			if (!plan) return;
+			for (size_t i = 0; i < counts.size(); ++i) {
+				auto &p = *plan->predicates[i];
+				auto &c = counts[i];
+				p.evaluated += c.evaluated;
+				p.passed += c.passed;
+				p.timed += c.timed;
+				p.ns += c.ns;
+				c = {};
+			}
+			// opnieuw sorteren met wat alle threads samen gezien hebben
+			orders.clear();
+		}
+
+		void reset() {
+			flush();
+			plan = nullptr;
+		}
+	};
+
+	std::vector<FeatureInfo> features;
+	std::vector<std::unique_ptr<Predicate>> predicates;
+	static thread_local ThreadState state;
+
+	int max_stage() const {
+		int m = 0;
+		for (auto &f : features) m = std::max(m, f.stage);
+		return m;
+	}
+
+	// de voorwaarden van stage op volgorde van cost en daarna van het deel dat erdoor komt
+	std::vector<size_t> sorted(int stage) const {
+		std::vector<size_t> result;
+		for (size_t i = 0; i < predicates.size(); ++i) {
+			if (features[predicates[i]->feature].stage == stage) result.push_back(i);
+		}
+		// andere threads tellen ondertussen door, dus eerst vastleggen waarop gesorteerd wordt
+		std::vector<std::pair<double, double>> key(predicates.size());
+		for (auto i : result) key[i] = {features[predicates[i]->feature].cost, pass_rate(i)};
+		std::stable_sort(result.begin(), result.end(), [&key](size_t a, size_t b) {
+			return key[a] < key[b];
+		});
+		return result;
+	}
+
+	// zonder metingen wordt de volgorde uit de configuratie aangehouden
+	double pass_rate(size_t i) const {
+		uint64_t evaluated = predicates[i]->evaluated, passed = predicates[i]->passed;
+		return evaluated? double(passed) / double(evaluated): 1;
+	}
+
+	static bool test(const Predicate &p, double x) {
+		if (p.absolute) x = std::abs(x);
+		switch (p.op) {
+		case Op::less: return x < p.value;
+		case Op::less_equal: return x <= p.value;
+		case Op::greater: return x > p.value;
+		case Op::greater_equal: return x >= p.value;
+		case Op::equal: return x == p.value;
+		case Op::not_equal: return x != p.value;
+		}
+		return false;
+	}
+
+	static std::string trim(const std::string &s) {
+		auto begin = s.find_first_not_of(" \t\r");
+		if (begin == std::string::npos) return "";
+		return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+	}
+
+	// [!]feature, abs(feature) op getal of feature op getal
+	bool parse(std::string text, Predicate &p) const {
+		text = trim(text);
+		if (!text.empty() && text[0] == '!') {
+			p.op = Op::equal;
+			p.value = 0;
+			return find(trim(text.substr(1)), p.feature);
+		}
+
+		auto at = text.find_first_of("<>=!");
+		if (at == std::string::npos) {
+			p.op = Op::not_equal;
+			p.value = 0;
+			return find(text, p.feature);
+		}
+
+		auto name = trim(text.substr(0, at));
+		if (name.size() > 5 && !name.compare(0, 4, "abs(") && name.back() == ')') {
+			p.absolute = true;
+			name = trim(name.substr(4, name.size() - 5));
+		}
+
+		static const std::pair<const char *, Op> OPS[] = {
+			{"<=", Op::less_equal}, {">=", Op::greater_equal}, {"==", Op::equal}, {"!=", Op::not_equal}, {"<", Op::less}, {">", Op::greater},
+		};
+		auto rest = text.substr(at);
+		for (auto [symbol, op] : OPS) {
+			if (rest.compare(0, strlen(symbol), symbol)) continue;
+			auto number = trim(rest.substr(strlen(symbol)));
+			char *end = nullptr;
+			p.op = op;
+			p.value = std::strtod(number.data(), &end);
+			return !number.empty() && *end == 0 && find(name, p.feature);
+		}
+		return false;
+	}
+
+	bool find(const std::string &name, int &feature) const {
+		for (size_t i = 0; i < features.size(); ++i) {
+			if (name == features[i].name) {
+				feature = i;
+				return true;
+			}
+		}
+		std::cerr << "Unknown feature '" << name << "'\n";
+		return false;
+	}
+};
+
+inline thread_local QueryPlan::ThreadState QueryPlan::state;
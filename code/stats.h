@@ -0,0 +1,230 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <condition_variable>
+
+/*
+	Verdeling van tijden in buckets die steeds 2^(1/4) groter worden, van 1 us tot ruim een uur.
+	Een percentiel is de bovengrens van zijn bucket, dus hoogstens 19% te hoog.
+	add mag vanuit meerdere threads tegelijk.
+*/
+class LatencyHistogram {
+public:
+	static constexpr int BUCKETS = 4 * 32;
+
+	void add(double seconds) {
+		++buckets[bucket(seconds)];
+		++count;
+		// geen atomic<double> +=, dus in ns
+		sum_ns += uint64_t(seconds * 1e9);
+	}
+
+	// de tijd waaronder een fractie q van de tijden sinds de vorige reset valt
+	double percentile(double q) const {
+		uint64_t total = 0;
+		for (auto &b : buckets) total += b;
+		if (!total) return 0;
+		uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(q * double(total)))), seen = 0;
+		for (int i = 0; i < BUCKETS; ++i) {
+			seen += buckets[i];
+			if (seen >= rank) return upper_bound(i);
+		}
+		return upper_bound(BUCKETS - 1);
+	}
+
+	// alleen de buckets; count en sum lopen door, zoals Prometheus verwacht
+	void reset() {
+		for (auto &b : buckets) b = 0;
+	}
+
+	uint64_t total_count() const {
+		return count;
+	}
+
+	double total_seconds() const {
+		return 1e-9 * double(sum_ns);
+	}
+
+private:
+	std::atomic<uint64_t> buckets[BUCKETS]{};
+	std::atomic<uint64_t> count{0}, sum_ns{0};
+
+	static int bucket(double seconds) {
+		if (!(seconds > 1e-6)) return 0;
+		return std::min(BUCKETS - 1, int(std::ceil(4 * std::log2(seconds * 1e6))));
+	}
+
+	static double upper_bound(int i) {
+		return 1e-6 * std::exp2(i / 4.);
+	}
+};
+
+/*
+	Tellers en tijden van compressor auto en watch, die zolang er een Publisher is elke
+	interval ms als Prometheus tekst naar een bestand geschreven worden (bijvoorbeeld voor de
+	textfile collector van node_exporter), ook als de compressor ergens op staat te wachten.
+	Het bestand wordt in 1 keer vervangen, dus een lezer ziet nooit een half bestand.
+
+	De stages zijn:
+	wait: wachten tot het volgende rauwe bestand er is
+	sleep: de vaste wachttijd voordat een bestand gelezen wordt
+	read: lezen en parsen van een rauw bestand
+	label: deeltjes zoeken
+	write: deeltjes coderen en wegschrijven
+	De percentielen zijn over de tijden sinds de vorige keer schrijven.
+*/
+class IngestStats {
+public:
+	enum Stage { wait, sleep, read, label, write, STAGES };
+	static constexpr const char *STAGE_NAMES[STAGES] = {"wait", "sleep", "read", "label", "write"};
+
+	using clock = std::chrono::steady_clock;
+
+	// meet de tijd tot het einde van de scope
+	class Timer {
+	public:
+		Timer(IngestStats &stats, Stage stage) : stats(stats), stage(stage), start(clock::now()) {}
+
+		~Timer() {
+			stats.stages[stage].add(std::chrono::duration<double>(clock::now() - start).count());
+		}
+
+	private:
+		IngestStats &stats;
+		Stage stage;
+		clock::time_point start;
+	};
+
+	std::atomic<uint64_t> frames{0}, particles{0}, bytes_written{0};
+	// rauwe bestanden die verwerkt maar nog niet verwijderd zijn
+	std::atomic<uint64_t> raw_pending{0};
+	// seconden tussen het schrijven van het laatste verwerkte rauwe bestand en het wegschrijven van zijn deeltjes
+	std::atomic<double> lag{0};
+
+	/*
+		Schrijft de stats in een eigen thread tot de Publisher weg is, en dan nog 1 keer.
+		backlog geeft het aantal rauwe bestanden dat klaar staat maar nog niet gelezen is;
+		het wordt vanuit die thread aangeroepen.
+	*/
+	class Publisher {
+	public:
+		Publisher(IngestStats &stats, std::function<uint64_t()> backlog) : stats(stats) {
+			if (stats.file_name.empty()) return;
+			stats.backlog = std::move(backlog);
+			thread = std::thread([this] {
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!done) {
+					changed.wait_for(lock, this->stats.interval);
+					this->stats.publish();
+				}
+			});
+		}
+
+		Publisher(const Publisher &) = delete;
+		Publisher &operator=(const Publisher &) = delete;
+
+		~Publisher() {
+			if (!thread.joinable()) return;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				done = true;
+				changed.notify_all();
+			}
+			thread.join();
+			stats.backlog = nullptr;
+		}
+
+	private:
+		IngestStats &stats;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable changed;
+		bool done = false;
+	};
+
+	// zonder file_name wordt er alleen geteld
+	void publish_to(std::string file_name, int interval_ms) {
+		this->file_name = std::move(file_name);
+		interval = std::chrono::milliseconds(std::max(1, interval_ms));
+	}
+
+	Timer time(Stage stage) {
+		return Timer(*this, stage);
+	}
+
+private:
+	LatencyHistogram stages[STAGES];
+	std::string file_name;
+	clock::duration interval = std::chrono::seconds(1);
+	std::function<uint64_t()> backlog;
+
+	clock::time_point last_publish = clock::now();
+	uint64_t last_frames = 0, last_particles = 0;
+	bool failed = false;
+
+	void publish() {
+		auto now = clock::now();
+		double elapsed = std::chrono::duration<double>(now - last_publish).count();
+		uint64_t f = frames, p = particles;
+		double frame_rate = (f - last_frames) / elapsed, particle_rate = (p - last_particles) / elapsed;
+		last_publish = now;
+		last_frames = f;
+		last_particles = p;
+
+		auto temporary = file_name + ".tmp";
+		std::ofstream out(temporary);
+		write_metrics(out, f, p, frame_rate, particle_rate);
+		out.close();
+		if (!out || std::rename(temporary.data(), file_name.data())) {
+			if (!failed) std::cerr << strerror(errno) << ':' << file_name << '\n';
+			failed = true;
+		}
+	}
+
+	static void metric(std::ostream &out, const char *name, const char *type, const char *help) {
+		out << "# HELP muon_compressor_" << name << ' ' << help << "\n# TYPE muon_compressor_" << name << ' ' << type << '\n';
+	}
+
+	void write_metrics(std::ostream &out, uint64_t f, uint64_t p, double frame_rate, double particle_rate) {
+		metric(out, "frames_total", "counter", "Raw frames compressed.");
+		out << "muon_compressor_frames_total " << f << '\n';
+		metric(out, "particles_total", "counter", "Particles written.");
+		out << "muon_compressor_particles_total " << p << '\n';
+		metric(out, "bytes_written_total", "counter", "Bytes appended to the batch file.");
+		out << "muon_compressor_bytes_written_total " << bytes_written << '\n';
+		metric(out, "frames_per_second", "gauge", "Frames compressed per second since the previous update.");
+		out << "muon_compressor_frames_per_second " << frame_rate << '\n';
+		metric(out, "particles_per_second", "gauge", "Particles written per second since the previous update.");
+		out << "muon_compressor_particles_per_second " << particle_rate << '\n';
+		if (backlog) {
+			metric(out, "backlog_frames", "gauge", "Raw frames that are complete but not read yet.");
+			out << "muon_compressor_backlog_frames " << backlog() << '\n';
+		}
+		metric(out, "raw_files_pending", "gauge", "Raw frames compressed but not yet flushed and removed.");
+		out << "muon_compressor_raw_files_pending " << raw_pending << '\n';
+		metric(out, "lag_seconds", "gauge", "Time from the last raw frame being written until its particles were written.");
+		out << "muon_compressor_lag_seconds " << lag << '\n';
+
+		metric(out, "stage_seconds", "summary", "Time per frame in each stage; quantiles since the previous update.");
+		for (int s = 0; s < STAGES; ++s) {
+			auto &h = stages[s];
+			for (double q : {.5, .9, .99}) {
+				out << "muon_compressor_stage_seconds{stage=\"" << STAGE_NAMES[s] << "\",quantile=\"" << q << "\"} " << h.percentile(q) << '\n';
+			}
+			out << "muon_compressor_stage_seconds_sum{stage=\"" << STAGE_NAMES[s] << "\"} " << h.total_seconds() << '\n';
+			out << "muon_compressor_stage_seconds_count{stage=\"" << STAGE_NAMES[s] << "\"} " << h.total_count() << '\n';
+			h.reset();
+		}
+	}
+};
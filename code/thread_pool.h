@@ -0,0 +1,149 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+/*
+	Work-stealing thread pool.
+
+	Elke worker heeft een eigen deque. De worker pakt zijn eigen werk van achteren
+	en steelt van voren bij de anderen als hij zelf niets meer heeft.
+*/
+class ThreadPool {
+public:
+	using Task = std::function<void()>;
+
+	explicit ThreadPool(unsigned thread_count) {
+		if (!thread_count) thread_count = default_thread_count();
+		for (unsigned i = 0; i < thread_count; ++i) queues.push_back(std::make_unique<Queue>());
+		for (unsigned i = 0; i < thread_count; ++i) threads.emplace_back([this, i] { run(i); });
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &t : threads) t.join();
+	}
+
+	static unsigned default_thread_count() {
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	unsigned size() const {
+		return (unsigned)threads.size();
+	}
+
+	void submit(Task task) {
+		unsigned id = current_worker == this? current_id: next_queue++ % size();
+		{
+			std::lock_guard<std::mutex> lock(queues[id]->mutex);
+			queues[id]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			++pending;
+		}
+		wake.notify_one();
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	size_t pending = 0;
+	bool stopping = false;
+	std::atomic<unsigned> next_queue{0};
+
+	static inline thread_local const ThreadPool *current_worker = nullptr;
+	static inline thread_local unsigned current_id = 0;
+
+	bool take(unsigned id, Task &task) {
+		{
+			auto &own = *queues[id];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+		for (unsigned i = 1; i < size(); ++i) {
+			auto &other = *queues[(id + i) % size()];
+			std::lock_guard<std::mutex> lock(other.mutex);
+			if (!other.tasks.empty()) {
+				task = std::move(other.tasks.front());
+				other.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void run(unsigned id) {
+		current_worker = this;
+		current_id = id;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				wake.wait(lock, [this] { return pending || stopping; });
+				if (!pending) return;
+				--pending;
+			}
+			// pending telt taken die nog in een deque staan, dus er is er zeker een te vinden
+			Task task;
+			while (!take(id, task)) std::this_thread::yield();
+			task();
+		}
+	}
+};
+
+/*
+	Een eigen T voor elke thread die local() aanroept, voor een reductie: elke thread werkt
+	zonder locks in zijn eigen T en na afloop worden ze met for_each samengevoegd.
+	local() zoekt onder een lock, dus haal hem niet per pixel op.
+*/
+template <typename T>
+class PerThread {
+public:
+	explicit PerThread(std::function<T()> make) : make(std::move(make)) {}
+
+	T &local() {
+		auto id = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &[owner, value] : values) {
+			if (owner == id) return *value;
+		}
+		values.emplace_back(id, std::make_unique<T>(make()));
+		return *values.back().second;
+	}
+
+	// pas aanroepen als geen thread meer met local() bezig is
+	template <typename Function>
+	void for_each(Function f) {
+		for (auto &[owner, value] : values) f(*value);
+	}
+
+private:
+	std::function<T()> make;
+	std::mutex mutex;
+	std::vector<std::pair<std::thread::id, std::unique_ptr<T>>> values;
+};